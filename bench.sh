@@ -0,0 +1,51 @@
+#!/bin/bash
+# Loopback benchmark: plain sendto/recv path vs UDP_SEGMENT/UDP_GRO path.
+# Usage: ./bench.sh [SIZE-IN-KB] [RUNS] [PORT]
+
+SIZE_KB=${1:-4096}
+RUNS=${2:-3}
+PORT=${3:-9118}
+
+BENCH_DIR=$(mktemp -d)
+trap 'rm -rf "$BENCH_DIR"' EXIT
+SRC_DIR=$(pwd)
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > "$BENCH_DIR/input.data"
+
+run()
+{
+    local flags=$1
+    local total=0
+
+    for ((i = 0; i < RUNS; i++))
+    {
+        # every run starts cold: a full handshake, no fast open cookie
+        # and no cwnd seeded from an earlier run's path metrics
+        rm -f "$BENCH_DIR/fastopen.cookies" "$BENCH_DIR/path.metrics"
+        (cd "$BENCH_DIR" && exec "$SRC_DIR/server" $flags $PORT input.data > /dev/null 2>&1) &
+        local server_pid=$!
+        sleep 0.2
+
+        local start=$(date +%s%N)
+        (cd "$BENCH_DIR" && "$SRC_DIR/client" $flags 127.0.0.1 $PORT > /dev/null 2>&1)
+        local end=$(date +%s%N)
+        kill $server_pid 2> /dev/null
+        wait $server_pid 2> /dev/null
+
+        if ! cmp -s "$BENCH_DIR/input.data" "$BENCH_DIR/received.data"
+        then
+            echo "transfer with flags '$flags' corrupted the file" >&2
+            exit 1
+        fi
+        total=$((total + (end - start) / 1000))
+    }
+
+    local avg_us=$((total / RUNS))
+    echo "$2: ${avg_us} us avg, $((SIZE_KB * 1024 * 1000000 / avg_us / 1024)) KB/s"
+}
+
+make -s server client > /dev/null 2>&1 || { echo "build failed" >&2; exit 1; }
+echo "${SIZE_KB} KB over loopback, ${RUNS} runs each"
+run "" "plain sendto"
+run "-g" "UDP GSO/GRO "
+run "-u" "io_uring    "
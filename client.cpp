@@ -1,4 +1,8 @@
-#include "packet.h"
+#include "client_connection.h"
+#include "udp_offload.h"
+#include "cookie.h"
+#include "sync.h"
+#include "uring.h"
 #include <cstring> // for memset
 #include <iostream> // for cout
 #include <stdio.h> // for perror
@@ -9,204 +13,612 @@
 #include <ctime> // for time
 #include <cstdlib> // for srand, rand
 #include <unistd.h> // for close
-#include <unordered_map> // for map
+#include <fcntl.h> // for fcntl, open
+#include <errno.h> // for errno
+#include <sys/epoll.h> // for epoll_wait
 #include <fstream> // for ofstream
+#include <getopt.h> // for getopt
+#include <vector> // for vector
+#include <deque> // for deque
+#include <unordered_set> // for set
 
 using namespace std;
 
-const uint16_t MAX_RECV_WINDOW = 15360;
+const uint16_t URING_ENTRIES = 256; // submission queue size
+const uint16_t URING_RECVS = 16; // datagram receives kept posted
+const uint16_t URING_SENDS = 64; // ACKs in flight to the kernel at once
+const uint16_t URING_WRITES = 8; // file writes in flight at once
+
+// what the client asks for and where the answers go
+struct Session
+{
+    string                  server; // "host:port", the key the cookie is kept under
+    struct sockaddr_storage server_addr; // the socket is not connected, so the client can move
+    socklen_t               server_addr_len;
+    uint64_t                cookie;
+    string                  sync_dir;
+    vector<string>          names;
+    size_t                  n_request;
+    vector<Manifest_file>   sync_files;
+    Chunk_index             sync_index;
+    uint64_t                move_after; // bytes to receive before moving to a new port, 0 for never
+    uint64_t                received;
+};
 
 void process_error(int status, const string &function);
-void process_recv(int n_bytes, const string &function, int sockfd, Packet_info &last_ack, const RTO &rto);
-int set_up_socket(char* argv[]);
-bool valid_pkt(const Packet &p, uint16_t base_num, const unordered_map<uint16_t, Packet_info> &window);
-struct timeval time_left(const Packet_info &last_ack);
+void send_all(int sockfd, Client_connection &conn, const Session &session);
+size_t drain(Client_connection &conn, ofstream &output);
+void handle_connected(Client_connection &conn, Session &session);
+void next_request(Client_connection &conn, Session &session);
+bool from_server(const struct sockaddr_storage &addr, socklen_t addr_len, const Session &session);
+bool time_to_move(Session &session);
+int new_socket(const Session &session);
+void receive_epoll(int &sockfd, Client_connection &conn, Session &session, bool gro);
+#ifdef HAVE_IO_URING
+void receive_uring(Uring &ring, int &sockfd, Client_connection &conn, Session &session);
+#endif
+int set_up_socket(char* host, char* port, Session &session);
+string output_name(const vector<string> &names, size_t i, const string &sync_dir);
+void plan_sync(const string &dir, vector<Manifest_file> &files, Chunk_index &index, vector<string> &names);
+void finish_sync(const string &dir, const vector<Manifest_file> &files, Chunk_index &index, size_t n_responses);
 
 int main(int argc, char* argv[])
 {
-    if (argc != 3)
+    bool gro = false;
+    bool uring = false;
+    Session session;
+    session.move_after = 0;
+    session.received = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "gum:s:")) != -1)
+    {
+        if (opt == 'g')
+        {
+            gro = true;
+        }
+        else if (opt == 'u')
+        {
+            uring = true;
+        }
+        else if (opt == 'm')
+        {
+            session.move_after = strtoull(optarg, NULL, 10) * 1024;
+        }
+        else if (opt == 's')
+        {
+            session.sync_dir = optarg;
+        }
+        else
+        {
+            optind = argc + 1; // force usage message
+            break;
+        }
+    }
+
+    if (argc - optind < 2 || (!session.sync_dir.empty() && argc - optind > 3))
     {
-        cout << "Usage: " << argv[0] << " SERVER-HOST-OR-IP PORT-NUMBER" << endl;
+        cout << "Usage: " << argv[0] << " [-g] [-u] [-m KB] SERVER-HOST-OR-IP PORT-NUMBER [FILE-NAME...]" << endl;
+        cout << "       " << argv[0] << " [-g] [-u] [-m KB] -s LOCAL-DIR SERVER-HOST-OR-IP PORT-NUMBER [REMOTE-DIR]" << endl;
         return 1;
     }
 
-    int sockfd = set_up_socket(argv);
-    int status, n_bytes;
-    Packet p;
-    Packet_info last_ack;
-    struct timeval time_left_tv;
+    // every name after the first goes out in the ACK for the previous file
+    vector<string> &names = session.names;
+    names.assign(argv + optind + 2, argv + argc);
+    if (!session.sync_dir.empty()) // sync asks for a manifest first, chunk requests follow
+    {
+        names.assign(1, string(SYNC_MANIFEST) + " " + (argc - optind == 3 ? argv[optind + 2] : ""));
+        mkdir(session.sync_dir.c_str(), 0755);
+        mkdir((session.sync_dir + "/" + SYNC_STAGING).c_str(), 0755);
+    }
+    else if (names.empty())
+    {
+        names.push_back("");
+    }
+    for (const string &name : names)
+    {
+        if (name.size() > DEFAULT_MSS - SYN_OPTIONS_LEN)
+        {
+            cerr << "file name too long: " << name << endl;
+            return 1;
+        }
+    }
+    session.n_request = 0;
+    session.server = string(argv[optind]) + ":" + argv[optind + 1];
+
+    int sockfd = set_up_socket(argv[optind], argv[optind + 1], session);
 
-    // select random seq_num
+    // select random seq_num, the first request rides in the SYN
     srand(time(NULL));
-    uint16_t seq_num = rand() % MSN;
-    uint16_t base_num;
+    session.cookie = load_cookie(session.server);
+    Client_connection conn(rand() % MSN, session.cookie, names[0], names.size() > 1 || !session.sync_dir.empty());
+    conn.set_log(&cout);
 
-    RTO rto;
+    bool served = false;
+    if (uring)
+    {
+#ifdef HAVE_IO_URING
+        Uring ring;
+        if (ring.init(URING_ENTRIES))
+        {
+            if (gro)
+                cerr << "UDP_GRO is not used with io_uring, receiving one datagram per packet" << endl;
+            receive_uring(ring, sockfd, conn, session);
+            served = true;
+        }
+#endif
+        if (!served)
+            cerr << "io_uring not available, using epoll" << endl;
+    }
+    if (!served)
+    {
+        receive_epoll(sockfd, conn, session, gro);
+    }
+    close(sockfd);
 
-    // send SYN segment
-    p = Packet(1, 0, 0, seq_num, 0, MAX_RECV_WINDOW, "", 0);
-    last_ack = Packet_info(p, 0, rto.get_timeout());
-    status = send(sockfd, (void *) &p, HEADER_LEN, 0);
-    process_error(status, "sending SYN");
-    seq_num = (seq_num + 1) % MSN; // SYN packet takes up 1 sequence
-    cout << "Sending packet SYN" << endl;
+    if (!session.sync_dir.empty())
+    {
+        finish_sync(session.sync_dir, session.sync_files, session.sync_index, session.n_request + 1);
+    }
+}
 
-    // recv SYN ACK
-    do
+// keep the server's cookie so the next connection can skip a round trip
+void handle_connected(Client_connection &conn, Session &session)
+{
+    if (conn.cookie() != session.cookie)
     {
-        time_left_tv = time_left(last_ack);
-        status = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&time_left_tv, sizeof(time_left_tv));
-        process_error(status, "setsockopt");
-        n_bytes = recv(sockfd, (void *) &p, sizeof(p), 0);
-        process_recv(n_bytes, "recv SYN ACK", sockfd, last_ack, rto);
-    } while (!p.syn_set() || !p.ack_set());
-    cout << "Receiving packet " << p.seq_num() << endl;
-    base_num = (p.seq_num() + 1) % MSN;
-
-    // send ACK after SYN ACK
-    p = Packet(0, 1, 0, seq_num, base_num, MAX_RECV_WINDOW, "", 0);
-    last_ack = Packet_info(p, n_bytes - HEADER_LEN, rto.get_timeout());
-    status = send(sockfd, (void *) &p, HEADER_LEN, 0);
-    process_error(status, "sending ACK after SYN ACK");
-    cout << "Sending packet " << p.ack_num() << endl;
-    seq_num = (seq_num + 1) % MSN;
-
-    // receive until a FIN segment is recv'd
-    unordered_map<uint16_t, Packet_info> window;
-    ofstream output("received.data");
-    while (1)
+        save_cookie(session.server, conn.cookie());
+    }
+}
+
+// the last response is written out, ACK its end of file with the next request
+void next_request(Client_connection &conn, Session &session)
+{
+    if (!session.sync_dir.empty() && session.n_request == 0)
     {
-        // discard invalid acks
-        do
-        {
-            time_left_tv = time_left(last_ack);
-            status = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&time_left_tv, sizeof(time_left_tv));
-            process_error(status, "setsockopt");
-            n_bytes = recv(sockfd, (void *) &p, sizeof(p), 0);
-            process_recv(n_bytes, "recv file", sockfd, last_ack, rto);
-            if (n_bytes == -1) // if timeout, continue receiving
-                continue;
-        } while (!valid_pkt(p, base_num, window));
+        plan_sync(session.sync_dir, session.sync_files, session.sync_index, session.names);
+    }
+    session.n_request++;
+    conn.request(session.names[session.n_request], session.n_request + 1 < session.names.size());
+}
+
+// the socket is not connected, so anyone could send to it
+bool from_server(const struct sockaddr_storage &addr, socklen_t addr_len, const Session &session)
+{
+    return addr_len == session.server_addr_len && memcmp(&addr, &session.server_addr, addr_len) == 0;
+}
+
+// -m: once enough has arrived, move to a new port the way a NAT rebinding
+// or an interface failover would, once per run
+bool time_to_move(Session &session)
+{
+    if (session.move_after == 0 || session.received < session.move_after)
+    {
+        return false;
+    }
+    session.move_after = 0;
+    cout << "Moving to a new local port" << endl;
+    return true;
+}
 
-        // update window
-        Packet_info new_pkt(p, n_bytes - HEADER_LEN, rto.get_timeout());
-        window.emplace(p.seq_num(), new_pkt);
-        for (auto it = window.find(base_num); it != window.end(); it = window.find(base_num))
+int new_socket(const Session &session)
+{
+    int sockfd = socket(session.server_addr.ss_family, SOCK_DGRAM, 0);
+    process_error(sockfd, "socket");
+    return sockfd;
+}
+
+void receive_epoll(int &sockfd, Client_connection &conn, Session &session, bool gro)
+{
+    if (gro && !enable_gro(sockfd))
+    {
+        cerr << "UDP_GRO not supported, receiving one datagram per packet" << endl;
+        gro = false;
+    }
+    Gro_reader reader(gro);
+    int status, n_bytes;
+
+    status = fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    process_error(status, "fcntl");
+    int epfd = epoll_create1(0);
+    process_error(epfd, "epoll_create1");
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    status = epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+    process_error(status, "epoll_ctl");
+
+    // receive until the server closes
+    ofstream output(output_name(session.names, session.n_request, session.sync_dir));
+    const char *datagram;
+    while (!conn.closed())
+    {
+        if (time_to_move(session))
         {
-            size_t len = it->second.data_len();
-            char buffer[len+1];
-            buffer[len] = '\0';
-            it->second.pkt().data(buffer, len);
-            output.write(buffer, len);
-            base_num = (base_num + len) % MSN;
-            window.erase(it);
+            int old_sockfd = sockfd;
+            sockfd = new_socket(session);
+            status = fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+            process_error(status, "fcntl");
+            if (gro)
+                enable_gro(sockfd);
+            status = epoll_ctl(epfd, EPOLL_CTL_DEL, old_sockfd, NULL);
+            process_error(status, "epoll_ctl");
+            ev.data.fd = sockfd;
+            status = epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+            process_error(status, "epoll_ctl");
+            close(old_sockfd);
+            conn.on_path_change();
         }
+        conn.on_timeout(now_us());
+        send_all(sockfd, conn, session);
+        if (conn.closed())
+            break;
 
-        // send FIN ACK if FIN segment
-        if (p.fin_set())
+        int wait_ms = -1;
+        uint64_t deadline = conn.next_timeout();
+        if (deadline != 0)
         {
-            base_num = (p.seq_num() + 1) % MSN; //consumed fin segment
-            p = Packet(0, 1, 1, seq_num, base_num, MAX_RECV_WINDOW, "", 0);
-            status = send(sockfd, (void *) &p, HEADER_LEN, 0);
-            process_error(status, "sending FIN ACK");
-            last_ack = Packet_info(p, 0, rto.get_timeout());
-            cout << "Sending packet " << p.ack_num() << " FIN" << endl;
-            seq_num = (seq_num + 1) % MSN;
-            break;
+            uint64_t now = now_us();
+            wait_ms = deadline > now ? (deadline - now + 999) / 1000 : 0;
         }
-        else // data segment so send ACK
+        status = epoll_wait(epfd, &ev, 1, wait_ms);
+        if (status == -1 && errno != EINTR)
+            process_error(status, "epoll_wait");
+
+        while ((n_bytes = reader.next(sockfd, datagram)) > 0)
         {
-            cout << "Receiving packet " << p.seq_num() << endl;
-            p = Packet(0, 1, 0, seq_num, base_num, MAX_RECV_WINDOW - sizeof(window), "", 0);
-            status = send(sockfd, (void *) &p, HEADER_LEN, 0);
-            process_error(status, "sending ACK for data packet");
-            last_ack = Packet_info(p, 0, rto.get_timeout());
-            cout << "Sending packet " << p.ack_num() << endl;
+            if (!from_server(reader.from(), reader.from_len(), session))
+                continue;
+            conn.on_datagram(datagram, n_bytes, now_us());
+            session.received += drain(conn, output);
+
+            Event e;
+            while (conn.poll_event(e))
+            {
+                if (e.type == EVENT_CONNECTED)
+                {
+                    handle_connected(conn, session);
+                }
+                else if (e.type == EVENT_RESPONSE_END)
+                {
+                    output.close();
+                    next_request(conn, session);
+                    output.open(output_name(session.names, session.n_request, session.sync_dir));
+                }
+            }
+
+            // answer each datagram before reading the next one
+            send_all(sockfd, conn, session);
         }
+        if (n_bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            process_error(n_bytes, "recv file");
     }
+    drain(conn, output);
     output.close();
+    close(epfd);
+}
 
-    // recv ACK
-    int tries = 0;
-    do
-    {
-        time_left_tv = time_left(last_ack);
-        status = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&time_left_tv, sizeof(time_left_tv));
-        process_error(status, "setsockopt");
-        n_bytes = recv(sockfd, (void *) &p, sizeof(p), 0);
-        process_recv(n_bytes, "recv ACK after FIN ACK", sockfd, last_ack, rto);
-        tries++;
-    } while (p.seq_num() != base_num && tries < 5); // discard invalid acks
+#ifdef HAVE_IO_URING
+enum Uring_op
+{
+    OP_RECV,
+    OP_SEND,
+    OP_WRITE,
+    OP_CANCEL
+};
 
-    cout << "Receiving packet " << p.seq_num() + 1 << endl;
+struct Uring_slot
+{
+    Transmit                t; // datagram received or being sent
+    struct sockaddr_storage addr; // where from or to
+    struct iovec            iov;
+    struct msghdr           msg;
+};
 
-    close(sockfd);
+void post_recv(Uring &ring, int sockfd, Uring_slot &slot, uint16_t index)
+{
+    memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.iov.iov_base = &slot.t.pkt;
+    slot.iov.iov_len = sizeof(slot.t.pkt);
+    slot.msg.msg_name = &slot.addr;
+    slot.msg.msg_namelen = sizeof(slot.addr);
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+    ring.recvmsg(sockfd, &slot.msg, ((uint64_t) OP_RECV << 32) | index);
 }
 
-void process_recv(int n_bytes, const string &function, int sockfd, Packet_info &last_ack, const RTO &rto)
+// a file write out of the receive buffer, its bytes are consumed once it
+// and every write before it are done
+struct Uring_write
 {
-    if (n_bytes == -1) //error
+    const char *data; // in the receive buffer
+    size_t      len;
+    size_t      done; // bytes the kernel has written so far
+};
+
+// the same as receive_epoll, but datagrams and file writes are queued on
+// the rings, and file writes go out straight from the receive buffer
+void receive_uring(Uring &ring, int &sockfd, Client_connection &conn, Session &session)
+{
+    vector<Uring_slot> recvs(URING_RECVS), sends(URING_SENDS);
+    vector<uint16_t> free_sends;
+    for (uint16_t i = 0; i < URING_SENDS; i++)
+    {
+        free_sends.push_back(i);
+    }
+    for (uint16_t i = 0; i < URING_RECVS; i++)
     {
-        // check if timed out
-        if (errno == EAGAIN || EWOULDBLOCK || EINPROGRESS)
+        post_recv(ring, sockfd, recvs[i], i);
+    }
+
+    string name = output_name(session.names, session.n_request, session.sync_dir);
+    int output = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    process_error(output, "open " + name);
+    // writes[i] is write number first_write + i and goes at output_offset
+    // plus the bytes of the writes before it
+    uint64_t output_offset = 0;
+    deque<Uring_write> writes;
+    uint32_t first_write = 0;
+    size_t queued = 0; // bytes handed to writes, not yet consumed
+    bool response_end = false;
+    while (!conn.closed() || !writes.empty() || conn.readable() != 0)
+    {
+        // the receives on the old socket come back cancelled and are
+        // posted again on the new one
+        if (time_to_move(session))
+        {
+            for (uint16_t i = 0; i < URING_RECVS; i++)
+            {
+                ring.cancel(((uint64_t) OP_RECV << 32) | i, (uint64_t) OP_CANCEL << 32);
+            }
+            int status = ring.submit_and_wait(0);
+            process_error(status, "io_uring_enter");
+            close(sockfd);
+            sockfd = new_socket(session);
+            conn.on_path_change();
+        }
+
+        uint64_t now = now_us();
+        conn.on_timeout(now);
+        Event e;
+        while (conn.poll_event(e))
+        {
+            if (e.type == EVENT_CONNECTED)
+                handle_connected(conn, session);
+            else if (e.type == EVENT_RESPONSE_END)
+                response_end = true;
+        }
+
+        // the next request waits until the last response is all written,
+        // the receive buffer holds nothing else until then
+        if (response_end && writes.empty() && conn.readable() == 0)
         {
-            // retransmit last packet
-            last_ack.update_time(rto.get_timeout());
-            Packet p = last_ack.pkt();
-            int status = send(sockfd, (void *) &p, sizeof(p), 0);
-            process_error(status, "sending FIN ACK");
-            cout << "Sending packet " << p.ack_num() << " Retransmission" << endl;
+            response_end = false;
+            close(output);
+            next_request(conn, session);
+            name = output_name(session.names, session.n_request, session.sync_dir);
+            output = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            process_error(output, "open " + name);
+            output_offset = 0;
         }
-        else // else another error and process it
+        const char *data;
+        size_t len;
+        while (writes.size() < URING_WRITES && (len = conn.peek(data, queued)) != 0)
         {
-            process_error(n_bytes, function);
+            uint32_t id = first_write + writes.size();
+            ring.write(output, data, len, output_offset + queued, ((uint64_t) OP_WRITE << 32) | id);
+            writes.push_back({data, len, 0});
+            queued += len;
+        }
+
+        while (!free_sends.empty())
+        {
+            Uring_slot &slot = sends[free_sends.back()];
+            if (!conn.poll_transmit(slot.t, now))
+                break;
+            memset(&slot.msg, 0, sizeof(slot.msg));
+            slot.iov.iov_base = &slot.t.pkt;
+            slot.iov.iov_len = slot.t.len;
+            slot.msg.msg_name = &session.server_addr;
+            slot.msg.msg_namelen = session.server_addr_len;
+            slot.msg.msg_iov = &slot.iov;
+            slot.msg.msg_iovlen = 1;
+            ring.sendmsg(sockfd, &slot.msg, ((uint64_t) OP_SEND << 32) | free_sends.back());
+            free_sends.pop_back();
+        }
+
+        int64_t wait_us = -1;
+        uint64_t deadline = conn.next_timeout();
+        if (deadline != 0)
+        {
+            now = now_us();
+            wait_us = deadline > now ? deadline - now : 0;
+        }
+        int status = ring.submit_and_wait(wait_us);
+        process_error(status, "io_uring_enter");
+
+        struct io_uring_cqe cqe;
+        while (ring.next_cqe(cqe))
+        {
+            uint16_t i = cqe.user_data & 0xffff;
+            switch (cqe.user_data >> 32)
+            {
+            case OP_RECV:
+                if (cqe.res < 0 && cqe.res != -ECANCELED)
+                {
+                    errno = -cqe.res;
+                    process_error(-1, "recv file");
+                }
+                if (cqe.res >= 0 && from_server(recvs[i].addr, recvs[i].msg.msg_namelen, session))
+                    conn.on_datagram((const char *) &recvs[i].t.pkt, cqe.res, now_us());
+                post_recv(ring, sockfd, recvs[i], i);
+                break;
+
+            case OP_SEND:
+                free_sends.push_back(i);
+                if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -ECANCELED) // dropped, the timer will resend it
+                {
+                    errno = -cqe.res;
+                    process_error(-1, "sending packet");
+                }
+                break;
+
+            case OP_WRITE:
+            {
+                if (cqe.res < 0)
+                {
+                    errno = -cqe.res;
+                    process_error(-1, "write " + name);
+                }
+                // a short write goes again for the rest, at the same place
+                uint32_t id = cqe.user_data & 0xffffffff;
+                Uring_write &w = writes[id - first_write];
+                uint64_t offset = output_offset;
+                for (uint32_t j = first_write; j != id; j++)
+                {
+                    offset += writes[j - first_write].len;
+                }
+                w.done += cqe.res;
+                if (w.done < w.len)
+                    ring.write(output, w.data + w.done, w.len - w.done, offset + w.done, cqe.user_data);
+                while (!writes.empty() && writes.front().done == writes.front().len)
+                {
+                    conn.consume(writes.front().len);
+                    output_offset += writes.front().len;
+                    session.received += writes.front().len;
+                    queued -= writes.front().len;
+                    writes.pop_front();
+                    first_write++;
+                }
+                break;
+            }
+
+            case OP_CANCEL: // ENOENT and EALREADY: the receive completes by itself
+                if (cqe.res < 0 && cqe.res != -ENOENT && cqe.res != -EALREADY)
+                {
+                    errno = -cqe.res;
+                    process_error(-1, "cancel receives");
+                }
+                break;
+            }
         }
     }
+    close(output);
 }
+#endif
 
-struct timeval time_left(const Packet_info &last_ack)
+void send_all(int sockfd, Client_connection &conn, const Session &session)
 {
-    struct timeval max_time = last_ack.get_max_time();
+    Transmit t;
+    uint64_t now = now_us();
+    while (conn.poll_transmit(t, now))
+    {
+        int status = sendto(sockfd, (const void *) &t.pkt, t.len, 0, (const struct sockaddr *) &session.server_addr, session.server_addr_len);
+        if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break; // dropped, the timer will resend it
+        process_error(status, "sending packet");
+    }
+}
 
-    struct timeval curr_time;
-    gettimeofday(&curr_time, NULL);
+// writes out whatever the connection has reassembled so far, straight
+// from its receive buffer, returns how much that was
+size_t drain(Client_connection &conn, ofstream &output)
+{
+    const char *data;
+    size_t n_bytes, total = 0;
+    while ((n_bytes = conn.peek(data)) != 0)
+    {
+        output.write(data, n_bytes);
+        conn.consume(n_bytes);
+        total += n_bytes;
+    }
+    return total;
+}
 
-    struct timeval time_left;
-    timersub(&max_time, &curr_time, &time_left);
+// a single file keeps the old received.data name, sync replies are
+// staged until the whole tree can be put together
+string output_name(const vector<string> &names, size_t i, const string &sync_dir)
+{
+    if (!sync_dir.empty())
+    {
+        return sync_dir + "/" + SYNC_STAGING + "/reply." + to_string(i);
+    }
+    if (names.size() == 1)
+    {
+        return "received.data";
+    }
 
-    return time_left;
+    size_t slash = names[i].rfind('/');
+    return "received." + (slash == string::npos ? names[i] : names[i].substr(slash + 1));
 }
 
-bool valid_pkt(const Packet &p, uint16_t base_num, const unordered_map<uint16_t, Packet_info> &window)
+// the manifest is in: index what we already have and ask for the rest
+void plan_sync(const string &dir, vector<Manifest_file> &files, Chunk_index &index, vector<string> &names)
 {
-    uint16_t seq = p.seq_num();
-    uint16_t max = (base_num + MSN/2) % MSN;
+    ifstream manifest(output_name(names, 0, dir));
+    if (!parse_manifest(manifest, files))
+    {
+        cerr << "bad sync manifest" << endl;
+        exit(1);
+    }
+    index_dir(dir, index);
 
-    if (base_num < max) // no overflow of window
+    // as many hashes per request as fit in a default sized segment
+    unordered_set<uint64_t> wanted;
+    uint64_t total_bytes = 0, new_bytes = 0;
+    string request = SYNC_CHUNKS;
+    for (const Manifest_file &file : files)
     {
-        if (seq >= base_num && seq <= max && window.find(seq) == window.end())
+        for (const Chunk &c : file.chunks)
         {
-            return true;
-        }
-        else
-        {
-            return false;
+            total_bytes += c.len;
+            if (index.count(c.hash) != 0 || !wanted.insert(c.hash).second)
+                continue;
+
+            new_bytes += c.len;
+            ostringstream hash;
+            hash << ' ' << hex << c.hash;
+            if (request.size() + hash.str().size() > DEFAULT_MSS - SYN_OPTIONS_LEN)
+            {
+                names.push_back(request);
+                request = SYNC_CHUNKS;
+            }
+            request += hash.str();
         }
     }
-    else // window overflowed
+
+    // always one more request, an empty one just closes the session
+    if (request.size() > strlen(SYNC_CHUNKS) || names.size() == 1)
     {
-        if (seq > max && seq < base_num && window.find(seq) == window.end())
-        {
-            return false;
-        }
-        else
-        {
-            return true;
-        }
+        names.push_back(request);
     }
+    cerr << "sync: " << files.size() << " files, " << total_bytes << " bytes, "
+         << wanted.size() << " new chunks, " << new_bytes << " bytes to fetch" << endl;
 }
 
-int set_up_socket(char* argv[])
+// every reply is in: check the new chunks and write out the tree
+void finish_sync(const string &dir, const vector<Manifest_file> &files, Chunk_index &index, size_t n_responses)
+{
+    vector<string> names;
+    for (size_t i = 1; i < n_responses; i++)
+    {
+        index_chunks(output_name(names, i, dir), index);
+    }
+    if (!assemble(dir, files, index))
+    {
+        cerr << "sync incomplete, missing or corrupt chunks" << endl;
+        exit(1);
+    }
+
+    for (size_t i = 0; i < n_responses; i++)
+    {
+        remove(output_name(names, i, dir).c_str());
+    }
+    rmdir((dir + "/" + SYNC_STAGING).c_str());
+}
+
+int set_up_socket(char* host, char* port, Session &session)
 {
     struct addrinfo hints;
     struct addrinfo *res;
@@ -219,14 +631,15 @@ int set_up_socket(char* argv[])
     hints.ai_flags = AI_PASSIVE;
 
     //set up socket calls
-    status = getaddrinfo(argv[1], argv[2], &hints, &res);
+    status = getaddrinfo(host, port, &hints, &res);
     if (status != 0)
     {
         cerr << "getaddrinfo error: " << gai_strerror(status) << endl;
         exit(1);
     }
 
-    // find socket to connect to
+    // find socket to send from, left unconnected so that the server still
+    // hears us if our address changes
     int sockfd;
     int yes = 1;
     auto i = res;
@@ -244,12 +657,8 @@ int set_up_socket(char* argv[])
             continue;
         }
 
-        status = connect(sockfd, res->ai_addr, res->ai_addrlen);
-        if (status == -1)
-        {
-            continue;
-        }
-
+        memcpy(&session.server_addr, i->ai_addr, i->ai_addrlen);
+        session.server_addr_len = i->ai_addrlen;
         break;
     }
     freeaddrinfo(res);
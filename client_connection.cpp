@@ -0,0 +1,314 @@
+#include "client_connection.h"
+#include "cookie.h"
+#include <cstring> // for memcpy
+#include <algorithm> // for min
+#include <arpa/inet.h> // for htons
+
+using namespace std;
+
+const uint16_t MAX_FIN_TRIES = 5; // FIN ACKs to send before giving up on the final ACK
+
+Client_connection::Client_connection(uint16_t isn, uint64_t cookie, const string &request, bool more)
+{
+    m_state = SYN_SENT;
+    m_log = NULL;
+    m_conn_id = 0;
+    m_cookie = cookie;
+    m_seq_num = isn % MSN;
+    m_tries = 0;
+    m_path_token = 0;
+    m_send_path_response = false;
+    m_adv_window = MAX_RECV_WINDOW;
+
+    // SYN segment carrying the largest segment we can take, our fast open
+    // cookie if we have one, and the first request
+    string syn_data(SYN_OPTIONS_LEN, '\0');
+    uint16_t syn_mss = htons(MAX_MSS);
+    memcpy(&syn_data[0], &syn_mss, sizeof(syn_mss));
+    memcpy(&syn_data[sizeof(syn_mss)], &cookie, COOKIE_LEN);
+    syn_data += request.substr(0, MAX_MSS - SYN_OPTIONS_LEN);
+    Packet p(1, 0, 0, m_seq_num, 0, MAX_RECV_WINDOW, syn_data.c_str(), syn_data.size());
+    p.set_more(more);
+    send_last(p, syn_data.size());
+    m_seq_num = (m_seq_num + 1) % MSN; // SYN packet takes up 1 sequence
+}
+
+void Client_connection::set_log(ostream *log)
+{
+    m_log = log;
+}
+
+void Client_connection::on_datagram(const char *buf, size_t len, uint64_t now)
+{
+    if (len < HEADER_LEN || m_state == CLOSED)
+        return;
+
+    // only the header is copied here, payload goes straight to its place
+    Packet p;
+    memcpy((void *) &p, buf, HEADER_LEN);
+    size_t data_len = min(len - HEADER_LEN, (size_t) MAX_MSS);
+    const char *data = buf + HEADER_LEN;
+
+    if (m_state == SYN_SENT) // recv SYN ACK
+    {
+        if (!p.syn_set() || !p.ack_set())
+            return;
+        if (m_log != NULL)
+            *m_log << "Receiving packet " << p.seq_num() << endl;
+        m_recv.reset(p.seq_num() + 1);
+        m_conn_id = p.conn_id();
+
+        // keep the server's cookie so the next connection can skip a round trip
+        if (data_len >= SYN_OPTIONS_LEN)
+        {
+            memcpy(&m_cookie, data + sizeof(uint16_t), COOKIE_LEN);
+        }
+
+        // send ACK after SYN ACK
+        send_last(Packet(0, 1, 0, m_seq_num, m_recv.base_num(), recv_window(), "", 0), 0);
+        if (m_log != NULL)
+            *m_log << "Sending packet " << m_recv.base_num() << endl;
+        m_seq_num = (m_seq_num + 1) % MSN;
+        m_state = ESTABLISHED;
+        m_events.push_back({EVENT_CONNECTED, "", false});
+        return;
+    }
+
+    if (p.conn_id() != m_conn_id) // left over from an earlier connection
+        return;
+
+    // the server checking that we really moved, answer from where we are
+    if (p.path_set())
+    {
+        if (data_len == PATH_TOKEN_LEN)
+        {
+            memcpy(&m_path_token, data, PATH_TOKEN_LEN);
+            m_send_path_response = true;
+        }
+        return;
+    }
+
+    if (m_state == FIN_RCVD) // recv ACK after FIN ACK
+    {
+        if (p.seq_num() != m_recv.base_num())
+            return;
+        if (m_log != NULL)
+            *m_log << "Receiving packet " << p.seq_num() + 1 << endl;
+        m_state = CLOSED;
+        m_events.push_back({EVENT_CLOSED, "", false});
+        return;
+    }
+
+    // path MTU probe, tell the server what size made it through
+    if (p.probe_set())
+    {
+        m_acks.push_back({p.seq_num(), (uint16_t) data_len, false, 0});
+        return;
+    }
+
+    // discard invalid packets, end of file and FIN only count in order;
+    // a duplicate, or a segment there is no room for, still gets an ACK
+    // so the server learns where we are and how much we can take
+    if (!m_recv.wanted(p.seq_num()) || ((p.fin_set() || p.more_set()) && p.seq_num() != m_recv.base_num())
+        || !m_recv.insert(p.seq_num(), data, data_len))
+    {
+        m_acks.push_back({m_recv.base_num(), 0, false, 0});
+        return;
+    }
+
+    if (p.fin_set()) // send FIN ACK
+    {
+        m_recv.skip(1); // consumed fin segment
+        send_last(Packet(0, 1, 1, m_seq_num, m_recv.base_num(), recv_window(), "", 0), 0);
+        if (m_log != NULL)
+            *m_log << "Sending packet " << m_recv.base_num() << " FIN" << endl;
+        m_seq_num = (m_seq_num + 1) % MSN;
+        m_state = FIN_RCVD;
+    }
+    else if (p.more_set()) // end of file, the application ACKs it with the next request
+    {
+        m_recv.skip(1); // consumed end of file segment
+        m_state = WAIT_REQUEST;
+        m_events.push_back({EVENT_RESPONSE_END, "", false});
+    }
+    else // data segment so send ACK
+    {
+        if (m_log != NULL)
+            *m_log << "Receiving packet " << p.seq_num() << endl;
+        m_acks.push_back({m_recv.base_num(), 0, true, p.seq_num()});
+        if (!m_send_last) // a queued control packet still has to go out first
+            m_last = Packet_info(Packet(0, 1, 0, m_seq_num, m_recv.base_num(), recv_window(), "", 0), 0, now, m_rto.get_timeout());
+        if (m_log != NULL)
+            *m_log << "Sending packet " << m_recv.base_num() << endl;
+    }
+}
+
+bool Client_connection::poll_transmit(Transmit &t, uint64_t now)
+{
+    t.probe = false;
+    t.challenge = false;
+    if (m_send_path_response)
+    {
+        m_send_path_response = false;
+        t.pkt = Packet(0, 1, 0, m_seq_num, m_recv.base_num(), recv_window(), (char *) &m_path_token, PATH_TOKEN_LEN);
+        t.pkt.set_path(true);
+        t.pkt.set_conn_id(m_conn_id);
+        t.len = HEADER_LEN + PATH_TOKEN_LEN;
+        if (m_log != NULL)
+            *m_log << "Sending path response" << endl;
+        return true;
+    }
+    if (!m_acks.empty())
+    {
+        Ack ack = m_acks.front();
+        m_acks.pop_front();
+        uint16_t option = htons(ack.probe_size != 0 ? ack.probe_size : ack.seq_num);
+        size_t option_len = ack.probe_size != 0 || ack.echo ? sizeof(option) : 0;
+        t.pkt = Packet(0, 1, 0, m_seq_num, ack.ack_num, recv_window(), (char *) &option, option_len);
+        m_adv_window = t.pkt.recv_window();
+        t.pkt.set_probe(ack.probe_size != 0);
+        t.pkt.set_conn_id(m_conn_id);
+        t.len = HEADER_LEN + option_len;
+        return true;
+    }
+    if (m_send_last)
+    {
+        m_send_last = false;
+        if (m_log != NULL && m_state == SYN_SENT && m_last.get_time_sent() == 0)
+            *m_log << "Sending packet SYN" << endl;
+        m_last.update_time(now, m_rto.get_timeout());
+        t.pkt = m_last.pkt();
+        t.pkt.set_conn_id(m_conn_id);
+        if (m_state != SYN_SENT) // resent ACKs carry the window as it is now
+        {
+            t.pkt.set_recv_window(recv_window());
+            m_adv_window = t.pkt.recv_window();
+        }
+        t.len = HEADER_LEN + m_last.data_len();
+        return true;
+    }
+    return false;
+}
+
+uint64_t Client_connection::next_timeout() const
+{
+    if (m_state == CLOSED || m_send_last)
+        return 0;
+    return m_last.get_max_time();
+}
+
+void Client_connection::on_timeout(uint64_t now)
+{
+    uint64_t deadline = next_timeout();
+    if (deadline == 0 || now < deadline)
+        return;
+
+    if (m_state == FIN_RCVD && ++m_tries >= MAX_FIN_TRIES)
+    {
+        // server must have its FIN ACK and gone away
+        m_state = CLOSED;
+        m_events.push_back({EVENT_CLOSED, "", false});
+        return;
+    }
+
+    // retransmit last packet
+    m_send_last = true;
+    if (m_log != NULL)
+        *m_log << "Sending packet " << m_last.pkt().ack_num() << " Retransmission" << endl;
+}
+
+void Client_connection::on_path_change()
+{
+    if (m_state != SYN_SENT && m_state != CLOSED)
+        m_send_last = true;
+}
+
+bool Client_connection::poll_event(Event &e)
+{
+    if (m_events.empty())
+        return false;
+    e = m_events.front();
+    m_events.pop_front();
+    return true;
+}
+
+size_t Client_connection::readable() const
+{
+    return m_recv.readable();
+}
+
+size_t Client_connection::read(char *buf, size_t len)
+{
+    size_t n_read = 0;
+    const char *data;
+    size_t n_bytes;
+    while (n_read < len && (n_bytes = m_recv.peek(data)) != 0)
+    {
+        n_bytes = min(n_bytes, len - n_read);
+        memcpy(buf + n_read, data, n_bytes);
+        m_recv.consume(n_bytes);
+        n_read += n_bytes;
+    }
+    on_read();
+    return n_read;
+}
+
+size_t Client_connection::peek(const char *&data, size_t skip) const
+{
+    return m_recv.peek(data, skip);
+}
+
+void Client_connection::consume(size_t len)
+{
+    m_recv.consume(len);
+    on_read();
+}
+
+bool Client_connection::request(const string &name, bool more)
+{
+    if (m_state != WAIT_REQUEST || name.size() > MAX_MSS)
+        return false;
+
+    Packet p(0, 1, 0, m_seq_num, m_recv.base_num(), recv_window(), name.c_str(), name.size());
+    p.set_more(more);
+    send_last(p, name.size());
+    if (m_log != NULL)
+        *m_log << "Sending packet " << m_recv.base_num() << " " << name << endl;
+    m_state = ESTABLISHED;
+    return true;
+}
+
+uint64_t Client_connection::cookie() const
+{
+    return m_cookie;
+}
+
+bool Client_connection::closed() const
+{
+    return m_state == CLOSED;
+}
+
+void Client_connection::send_last(const Packet &p, uint16_t data_len)
+{
+    m_last = Packet_info(p, data_len, 0, 0);
+    m_send_last = true;
+}
+
+// what the server may send past base_num: no more than is free in the ring
+uint16_t Client_connection::recv_window() const
+{
+    return min(m_recv.space(), (size_t) MAX_RECV_WINDOW);
+}
+
+// the application made room: once the window has opened from under half
+// to half or more, say so rather than wait for the server to find out;
+// if that is lost, the last ACK resent on timeout carries it too
+void Client_connection::on_read()
+{
+    if (m_state != ESTABLISHED || m_adv_window >= MAX_RECV_WINDOW / 2 || recv_window() < MAX_RECV_WINDOW / 2)
+        return;
+    m_acks.push_back({m_recv.base_num(), 0, false, 0});
+    m_adv_window = recv_window();
+    if (m_log != NULL)
+        *m_log << "Sending window update " << m_recv.base_num() << " " << m_adv_window << endl;
+}
@@ -0,0 +1,92 @@
+#ifndef CLIENT_CONNECTION_H
+#define CLIENT_CONNECTION_H
+
+#include "packet.h"
+#include "transport.h"
+#include "reassembly.h"
+#include <string> // for string
+#include <deque> // for deque
+#include <ostream> // for ostream
+
+// client side of one connection: sends the first request in the SYN,
+// reassembles each response for the application to read(), and asks for
+// the next one with request() until the server closes
+class Client_connection
+{
+public:
+    // cookie is the server's fast open cookie from an earlier connection, or 0
+    Client_connection(uint16_t isn, uint64_t cookie, const std::string &request, bool more);
+
+    // log lines like the ones the client binary prints, NULL for none
+    void set_log(std::ostream *log);
+
+    void on_datagram(const char *buf, size_t len, uint64_t now);
+    bool poll_transmit(Transmit &t, uint64_t now);
+
+    // absolute time on_timeout() wants to be called at, 0 if none
+    uint64_t next_timeout() const;
+    void on_timeout(uint64_t now);
+
+    bool poll_event(Event &e);
+
+    // the local address changed (a new socket, another interface): resend
+    // the last ACK so the server hears from the new one straight away
+    void on_path_change();
+
+    // in-order response bytes, either copied out or used in place; peek
+    // can look past bytes already handed out but not yet consumed
+    size_t readable() const;
+    size_t read(char *buf, size_t len);
+    size_t peek(const char *&data, size_t skip = 0) const;
+    void consume(size_t len);
+
+    // after EVENT_RESPONSE_END, returns false at any other time
+    bool request(const std::string &name, bool more);
+
+    // the cookie the server handed out, valid after EVENT_CONNECTED
+    uint64_t cookie() const;
+    bool closed() const;
+
+private:
+    enum State
+    {
+        SYN_SENT,
+        ESTABLISHED,
+        WAIT_REQUEST,
+        FIN_RCVD,
+        CLOSED
+    };
+
+    // a pending ACK, queued so duplicates reach the server one by one
+    struct Ack
+    {
+        uint16_t ack_num;
+        uint16_t probe_size; // path MTU probe ack if not 0
+        bool     echo; // tell the server which segment this is for (RACK)
+        uint16_t seq_num;
+    };
+
+    void send_last(const Packet &p, uint16_t data_len);
+    uint16_t recv_window() const;
+    void on_read();
+
+    State         m_state;
+    std::ostream *m_log;
+    uint32_t      m_conn_id; // the server's, from the SYN ACK on
+    uint64_t      m_cookie;
+    RTO           m_rto;
+    uint16_t      m_seq_num;
+    uint16_t      m_tries; // FIN ACKs sent without hearing back
+
+    Reassembly_buffer m_recv;
+
+    Packet_info     m_last; // retransmitted on timeout
+    bool            m_send_last;
+    std::deque<Ack> m_acks;
+    uint16_t        m_adv_window; // in the last ACK sent
+    uint64_t        m_path_token; // last path challenge, to echo
+    bool            m_send_path_response;
+
+    std::deque<Event> m_events;
+};
+#endif
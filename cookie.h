@@ -0,0 +1,147 @@
+#ifndef COOKIE_H
+#define COOKIE_H
+
+#include <cstring> // for memcpy
+#include <string> // for string
+#include <fstream> // for ifstream, ofstream
+#include <sstream> // for istringstream
+#include <vector> // for vector
+#include <fcntl.h> // for open
+#include <unistd.h> // for read, write, close
+#include <sys/socket.h> // for sockaddr_storage
+#include <netinet/in.h> // for sockaddr_in
+
+const uint16_t COOKIE_LEN = 8; // bytes
+const uint16_t KEY_LEN = 16; // bytes
+const char COOKIE_KEY_FILE[] = "fastopen.key"; // server secret, created on first run
+const char COOKIE_CACHE_FILE[] = "fastopen.cookies"; // client cookies, one server per line
+
+// SipHash-2-4, a keyed hash short enough to compute per SYN
+inline uint64_t siphash(const uint8_t key[KEY_LEN], const uint8_t *data, size_t len)
+{
+    uint64_t k0, k1;
+    memcpy(&k0, key, 8);
+    memcpy(&k1, key + 8, 8);
+
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    auto round = [&]()
+    {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    };
+
+    size_t n_words = len / 8;
+    for (size_t i = 0; i < n_words; i++)
+    {
+        uint64_t m;
+        memcpy(&m, data + i * 8, 8);
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+
+    uint64_t last = (uint64_t) len << 56;
+    for (size_t i = 0; i < len % 8; i++)
+    {
+        last |= (uint64_t) data[n_words * 8 + i] << (8 * i);
+    }
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    round();
+    round();
+    round();
+    round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// reads the server secret, creating a random one if there is none yet
+inline bool load_cookie_key(uint8_t key[KEY_LEN])
+{
+    int fd = open(COOKIE_KEY_FILE, O_RDONLY);
+    if (fd != -1)
+    {
+        ssize_t n_bytes = read(fd, key, KEY_LEN);
+        close(fd);
+        if (n_bytes == KEY_LEN)
+            return true;
+    }
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1)
+        return false;
+    ssize_t n_bytes = read(fd, key, KEY_LEN);
+    close(fd);
+    if (n_bytes != KEY_LEN)
+        return false;
+
+    fd = open(COOKIE_KEY_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return false;
+    n_bytes = write(fd, key, KEY_LEN);
+    close(fd);
+    return n_bytes == KEY_LEN;
+}
+
+// cookie binds the client's IP address, not its port, like TCP fast open
+inline uint64_t make_cookie(const uint8_t key[KEY_LEN], const struct sockaddr_storage &addr)
+{
+    if (addr.ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) &addr;
+        return siphash(key, (const uint8_t *) &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    const struct sockaddr_in *in = (const struct sockaddr_in *) &addr;
+    return siphash(key, (const uint8_t *) &in->sin_addr, sizeof(in->sin_addr));
+}
+
+// returns 0 if we have no cookie for this server
+inline uint64_t load_cookie(const std::string &server)
+{
+    std::ifstream cache(COOKIE_CACHE_FILE);
+    std::string line;
+    while (getline(cache, line))
+    {
+        std::istringstream fields(line);
+        std::string name;
+        uint64_t cookie;
+        if (fields >> name >> std::hex >> cookie && name == server)
+            return cookie;
+    }
+    return 0;
+}
+
+inline void save_cookie(const std::string &server, uint64_t cookie)
+{
+    std::vector<std::string> lines;
+    {
+        std::ifstream cache(COOKIE_CACHE_FILE);
+        std::string line;
+        while (getline(cache, line))
+        {
+            std::istringstream fields(line);
+            std::string name;
+            if (fields >> name && name != server)
+                lines.push_back(line);
+        }
+    }
+
+    std::ofstream cache(COOKIE_CACHE_FILE, std::ios::trunc);
+    for (const std::string &line : lines)
+    {
+        cache << line << '\n';
+    }
+    cache << server << ' ' << std::hex << cookie << '\n';
+}
+#endif
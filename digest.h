@@ -0,0 +1,122 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <cstdint> // for uint32_t
+#include <cstring> // for memcpy
+#include <string> // for string
+#include <algorithm> // for min
+
+const size_t DIGEST_HEX_LEN = 64; // characters from Sha256::hex()
+
+// SHA-256 (FIPS 180-4), fed in pieces; a sync checks whole files against
+// it, since a 64 bit chunk hash is only an index, not proof of content
+class Sha256
+{
+public:
+    Sha256()
+    {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(m_state, initial, sizeof(m_state));
+        m_len = 0;
+        m_buffered = 0;
+    }
+
+    void update(const char *data, size_t len)
+    {
+        m_len += len;
+        if (m_buffered != 0)
+        {
+            size_t n_bytes = std::min(len, sizeof(m_block) - m_buffered);
+            memcpy(m_block + m_buffered, data, n_bytes);
+            m_buffered += n_bytes;
+            data += n_bytes;
+            len -= n_bytes;
+            if (m_buffered < sizeof(m_block))
+                return;
+            compress(m_block);
+            m_buffered = 0;
+        }
+        for (; len >= sizeof(m_block); data += sizeof(m_block), len -= sizeof(m_block))
+        {
+            compress((const uint8_t *) data);
+        }
+        memcpy(m_block, data, len);
+        m_buffered = len;
+    }
+
+    // lowercase hex, the object is spent afterwards
+    std::string hex()
+    {
+        uint64_t bits = m_len * 8;
+        uint8_t pad[sizeof(m_block) + 8] = {0x80};
+        size_t pad_len = (m_buffered < 56 ? 56 : 120) - m_buffered;
+        for (int i = 0; i < 8; i++)
+        {
+            pad[pad_len + i] = bits >> (56 - 8 * i);
+        }
+        update((const char *) pad, pad_len + 8);
+
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (uint32_t word : m_state)
+        {
+            for (int shift = 28; shift >= 0; shift -= 4)
+            {
+                out += digits[(word >> shift) & 0xf];
+            }
+        }
+        return out;
+    }
+
+private:
+    void compress(const uint8_t *block)
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        auto rotr = [](uint32_t x, int b) { return (x >> b) | (x << (32 - b)); };
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t v[8];
+        memcpy(v, m_state, sizeof(v));
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+            uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+            uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+            uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+            memmove(v + 1, v, 7 * sizeof(uint32_t));
+            v[4] += t1;
+            v[0] = t1 + s0 + maj;
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            m_state[i] += v[i];
+        }
+    }
+
+    uint32_t m_state[8];
+    uint64_t m_len; // bytes fed so far
+    uint8_t  m_block[64];
+    size_t   m_buffered; // bytes of m_block waiting for the rest
+};
+#endif
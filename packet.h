@@ -4,13 +4,21 @@
 #include <string>
 #include <bitset>
 #include <cstring>
-#include <sys/time.h>
-
-const uint16_t MSS = 1024; // MAX IS 1032 but header is 8 bytes
-const uint16_t HEADER_LEN = 8; // bytes
-const uint16_t INITIAL_SSTHRESH = 3000; // bytes
+#include <algorithm> // for min, max
+#include <ctime> // for clock_gettime
+
+const uint16_t DEFAULT_MSS = 1024; // starting segment size, safe on any path
+const uint16_t MAX_MSS = 8192; // largest segment either side will negotiate
+const uint16_t HEADER_LEN = 12; // bytes
+const uint16_t PROBE_SIZES[] = {1460, 4096, 8192}; // 1500 MTU, then larger jumbo/loopback sizes
+const uint16_t MAX_PROBES = 3; // failed probes before a size is given up on
+const uint16_t SYN_OPTIONS_LEN = 10; // max segment size and fast open cookie in SYN/SYN ACK data
+const uint16_t PATH_TOKEN_LEN = 8; // bytes of a path challenge, echoed back in the response
 const uint16_t INITIAL_TIMEOUT = 1000; // ms, 1 sec since RTO adaption
-const uint16_t MSN = 30720; // bytes
+const uint16_t MIN_TIMEOUT = 200; // ms, keeps scheduling jitter from looking like loss
+const uint16_t MAX_TIMEOUT = 60000; // ms, cap for exponential backoff
+const uint16_t MSN = 61440; // bytes of sequence space, half of it may be in flight
+const uint16_t INITIAL_SSTHRESH = MSN / 2; // bytes, the most that may be in flight: a loss or HyStart ends slow start
 
 class Packet
 {
@@ -21,10 +29,14 @@ public:
         m_syn = syn;
         m_ack = ack;
         m_fin = fin;
+        m_probe = 0;
+        m_more = 0;
+        m_path = 0;
         m_seq_num = seq_num;
         m_ack_num = ack_num;
         m_recv_window = recv_window;
-        strncpy(m_data, data, len);
+        m_conn_id = 0;
+        memcpy(m_data, data, len);
     }
 
     bool syn_set() const
@@ -42,6 +54,58 @@ public:
         return m_fin;
     }
 
+    // probes test a larger segment size and do not use sequence space
+    bool probe_set() const
+    {
+        return m_probe;
+    }
+
+    void set_probe(bool probe)
+    {
+        m_probe = probe;
+    }
+
+    // keeps a session open: on a request, another request will follow;
+    // from the server, end of the current file (takes up 1 sequence)
+    bool more_set() const
+    {
+        return m_more;
+    }
+
+    void set_more(bool more)
+    {
+        m_more = more;
+    }
+
+    // path validation: a challenge from the server, or with ACK set the
+    // client's echo of one from its current address
+    bool path_set() const
+    {
+        return m_path;
+    }
+
+    void set_path(bool path)
+    {
+        m_path = path;
+    }
+
+    // picked by the server and carried by every packet but the client's
+    // SYN, so a connection survives the client's address changing
+    uint32_t conn_id() const
+    {
+        return m_conn_id;
+    }
+
+    void set_recv_window(uint16_t recv_window)
+    {
+        m_recv_window = recv_window;
+    }
+
+    void set_conn_id(uint32_t conn_id)
+    {
+        m_conn_id = conn_id;
+    }
+
     uint16_t seq_num() const
     {
         return m_seq_num;
@@ -59,31 +123,38 @@ public:
 
     void data(char* buffer, size_t len) const
     {
-        strncpy(buffer, m_data, len);
+        memcpy(buffer, m_data, len);
     }
 
 private:
     bool     m_syn:1;
     bool     m_ack:1;
     bool     m_fin:1;
+    bool     m_probe:1;
+    bool     m_more:1;
+    bool     m_path:1;
     uint16_t m_seq_num;  // 2 bytes
     uint16_t m_ack_num;  // 2 bytes
     uint16_t m_recv_window; // 2 bytes
-    char     m_data[MSS]; // MSS bytes
+    uint32_t m_conn_id;  // 4 bytes
+    char     m_data[MAX_MSS]; // up to the negotiated segment size
 };
 
 class Packet_info
 {
 public:
     Packet_info() = default;
-    Packet_info(Packet p, uint16_t data_len, const struct timeval &timeout)
+    Packet_info(Packet p, uint16_t data_len, uint64_t now, uint64_t timeout)
     {
         m_p = p;
         m_data_len = data_len;
-        update_time(timeout);
+        m_retransmitted = false;
+        m_delivered = false;
+        m_lost = false;
+        update_time(now, timeout);
     }
 
-    Packet pkt() const
+    const Packet &pkt() const
     {
         return m_p;
     }
@@ -93,98 +164,149 @@ public:
         return m_data_len;
     }
 
-    struct timeval get_max_time() const
+    uint64_t get_max_time() const
     {
         return m_max_time;
     }
 
-    struct timeval get_time_sent() const
+    uint64_t get_time_sent() const
     {
         return m_time_sent;
     }
 
-    void update_time(const struct timeval &timeout)
+    // RTT samples from retransmitted packets are ambiguous (Karn)
+    bool retransmitted() const
+    {
+        return m_retransmitted;
+    }
+
+    void set_retransmitted()
     {
-        gettimeofday(&m_time_sent, NULL);
+        m_retransmitted = true;
+    }
+
+    // the receiver has it, but the cumulative ACK has not got this far yet
+    bool delivered() const
+    {
+        return m_delivered;
+    }
+
+    void set_delivered()
+    {
+        m_delivered = true;
+    }
+
+    // counted as lost and waiting to be sent again
+    bool lost() const
+    {
+        return m_lost;
+    }
+
+    void set_lost(bool lost)
+    {
+        m_lost = lost;
+    }
+
+    void update_time(uint64_t now, uint64_t timeout)
+    {
+        m_time_sent = now;
 
         // find max_time for first packet
-        timeradd(&m_time_sent, &timeout, &m_max_time);
+        m_max_time = now + timeout;
     }
 
 private:
-    Packet m_p;
-    struct timeval m_time_sent;
-    struct timeval m_max_time;
-    uint16_t       m_data_len;
+    Packet   m_p;
+    uint64_t m_time_sent; // microseconds
+    uint64_t m_max_time; // microseconds
+    uint16_t m_data_len;
+    bool     m_retransmitted;
+    bool     m_delivered;
+    bool     m_lost;
 };
 
+// all times are microseconds on whatever clock the caller passes in
 class RTO
 {
 public:
     RTO()
     {
-        m_timeout.tv_usec = INITIAL_TIMEOUT * 1000; // microseconds
-        timerclear(&m_EstimatedRTT);
-        timerclear(&m_DevRTT);
+        m_timeout = INITIAL_TIMEOUT * 1000ULL;
+        m_EstimatedRTT = 0;
+        m_DevRTT = 0;
+        m_sampled = false;
     }
 
-    struct timeval get_timeout() const
+    uint64_t get_timeout() const
     {
         return m_timeout;
     }
 
-    void update_RTO(const struct timeval &time_sent)
+    uint64_t get_EstimatedRTT() const
+    {
+        return m_EstimatedRTT;
+    }
+
+    uint64_t get_DevRTT() const
     {
-        struct timeval curr_time;
-        gettimeofday(&curr_time, NULL);
+        return m_DevRTT;
+    }
 
-        struct timeval SampleRTT;
-        timersub(&curr_time, &time_sent, &SampleRTT);
+    bool sampled() const
+    {
+        return m_sampled;
+    }
 
-        multiply_timeval(SampleRTT, .125);
-        multiply_timeval(m_EstimatedRTT, .175);
+    // initial RTO from an earlier connection's estimates; the first real
+    // sample still starts the estimate over, in case the path changed
+    void seed(uint64_t EstimatedRTT, uint64_t DevRTT)
+    {
+        m_EstimatedRTT = EstimatedRTT;
+        m_DevRTT = DevRTT;
+        m_timeout = m_EstimatedRTT + 4 * m_DevRTT;
+        m_timeout = std::max(m_timeout, (uint64_t) MIN_TIMEOUT * 1000);
+        m_timeout = std::min(m_timeout, (uint64_t) MAX_TIMEOUT * 1000);
+    }
 
-        timeradd(&m_EstimatedRTT, &SampleRTT, &m_EstimatedRTT);
+    void update_RTO(uint64_t time_sent, uint64_t now)
+    {
+        uint64_t SampleRTT = now - time_sent;
 
-        struct timeval time_diff;
-        if (timercmp(&m_EstimatedRTT, &SampleRTT, >))
+        if (!m_sampled) // first sample, RFC 6298
         {
-            timersub(&m_EstimatedRTT, &SampleRTT, &time_diff);
+            m_EstimatedRTT = SampleRTT;
+            m_DevRTT = SampleRTT / 2;
+            m_sampled = true;
         }
         else
         {
-            timersub(&SampleRTT, &m_EstimatedRTT, &time_diff);
+            uint64_t time_diff = m_EstimatedRTT > SampleRTT ? m_EstimatedRTT - SampleRTT : SampleRTT - m_EstimatedRTT;
+            m_DevRTT = m_DevRTT * .75 + time_diff * .25;
+            m_EstimatedRTT = m_EstimatedRTT * .875 + SampleRTT * .125;
         }
 
-        multiply_timeval(time_diff, .25);
-        multiply_timeval(m_DevRTT, .75);
-
-        timeradd(&m_DevRTT, &time_diff, &m_DevRTT);
-
-        struct timeval new_DevRTT;
-        new_DevRTT.tv_sec = m_DevRTT.tv_sec;
-        new_DevRTT.tv_usec = m_DevRTT.tv_usec;
-
-        multiply_timeval(new_DevRTT, 4);
-        timeradd(&m_EstimatedRTT, &new_DevRTT, &m_timeout);
-        m_timeout.tv_sec = 0;
-        m_timeout.tv_usec = 0;
+        m_timeout = m_EstimatedRTT + 4 * m_DevRTT;
+        m_timeout = std::max(m_timeout, (uint64_t) MIN_TIMEOUT * 1000);
+        m_timeout = std::min(m_timeout, (uint64_t) MAX_TIMEOUT * 1000);
     }
 
     void double_RTO()
     {
-        multiply_timeval(m_timeout, 2);
-    }
-
-    void multiply_timeval(struct timeval &timeval, double factor)
-    {
-        timeval.tv_sec *= factor;
-        timeval.tv_usec *= factor;
+        m_timeout = std::min(m_timeout * 2, (uint64_t) MAX_TIMEOUT * 1000);
     }
 
 private:
-    struct timeval m_EstimatedRTT;
-    struct timeval m_DevRTT;
-    struct timeval m_timeout;
+    uint64_t m_EstimatedRTT;
+    uint64_t m_DevRTT;
+    uint64_t m_timeout;
+    bool     m_sampled;
 };
+
+// microseconds on a monotonic clock, for drivers to pass into the protocol engines
+inline uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 #endif
@@ -0,0 +1,93 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include "transport.h"
+#include <string> // for string
+#include <map> // for map
+#include <fstream> // for ifstream, ofstream
+#include <sstream> // for istringstream
+#include <cmath> // for pow
+#include <cstdio> // for rename
+
+const char PATH_CACHE_FILE[] = "path.metrics"; // server's metrics, one peer per line
+const uint64_t PATH_MAX_AGE = 3600; // s, after this nothing is known about a peer any more
+const uint64_t PATH_HALF_LIFE = 600; // s, ssthresh and bandwidth move halfway back to the defaults
+const uint64_t PATH_MIN_DELIVERED = 65536; // bytes, a shorter connection's bandwidth says little
+
+// per peer metrics kept across connections and restarts, in the spirit of
+// Linux's tcp_metrics: entries are keyed by IP address, age towards the
+// defaults and are forgotten after PATH_MAX_AGE
+class Path_cache
+{
+public:
+    // times are seconds on the wall clock, so ages survive a restart
+    void load(const std::string &file, uint64_t now)
+    {
+        std::ifstream in(file);
+        std::string line;
+        while (getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string peer;
+            Entry e;
+            e.metrics.delivered = 0;
+            if (fields >> peer >> e.metrics.srtt >> e.metrics.rttvar >> e.metrics.ssthresh >> e.metrics.bandwidth >> e.updated &&
+                e.updated <= now && now - e.updated < PATH_MAX_AGE)
+                m_entries[peer] = e;
+        }
+    }
+
+    bool save(const std::string &file) const
+    {
+        // written aside and renamed, so a crash never leaves half a file
+        std::string tmp = file + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            for (const auto &i : m_entries)
+            {
+                const Path_metrics &m = i.second.metrics;
+                out << i.first << ' ' << m.srtt << ' ' << m.rttvar << ' ' << m.ssthresh << ' '
+                    << m.bandwidth << ' ' << i.second.updated << '\n';
+            }
+            if (!out)
+                return false;
+        }
+        return rename(tmp.c_str(), file.c_str()) == 0;
+    }
+
+    // metrics to seed a connection to peer with, aged, false if none
+    bool lookup(const std::string &peer, uint64_t now, Path_metrics &metrics) const
+    {
+        auto i = m_entries.find(peer);
+        if (i == m_entries.end() || now < i->second.updated || now - i->second.updated >= PATH_MAX_AGE)
+            return false;
+
+        // the RTT of a path hardly moves, how much of it is free does
+        double fresh = pow(0.5, (double) (now - i->second.updated) / PATH_HALF_LIFE);
+        metrics = i->second.metrics;
+        metrics.ssthresh = INITIAL_SSTHRESH + (metrics.ssthresh - (double) INITIAL_SSTHRESH) * fresh;
+        metrics.bandwidth *= fresh;
+        return true;
+    }
+
+    // a connection's final metrics; one that moved too little data keeps
+    // the bandwidth already known
+    void update(const std::string &peer, uint64_t now, const Path_metrics &metrics)
+    {
+        Path_metrics merged = metrics;
+        Path_metrics old;
+        if (metrics.delivered < PATH_MIN_DELIVERED)
+            merged.bandwidth = lookup(peer, now, old) ? old.bandwidth : 0;
+        m_entries[peer] = {merged, now};
+    }
+
+private:
+    struct Entry
+    {
+        Path_metrics metrics;
+        uint64_t     updated; // s
+    };
+
+    std::map<std::string, Entry> m_entries;
+};
+#endif
@@ -0,0 +1,137 @@
+#ifndef PMTU_H
+#define PMTU_H
+
+#include "packet.h"
+#include <netinet/in.h> // for IPPROTO_IP
+#include <sys/socket.h> // for setsockopt
+
+const uint16_t PROBE_TIMEOUT = 1000; // ms, a lost probe costs no data so wait generously
+const uint16_t PROBE_RESOLUTION = 32; // bytes, stop searching once this close
+const uint16_t BLACK_HOLE_TIMEOUTS = 2; // timeouts in a row, with segments over DEFAULT_MSS, that mean large datagrams vanish
+const uint16_t MIN_WINDOW_SEGMENTS = 4; // segments the window (MSN/2) must hold, larger ones only slow a transfer down
+
+// sets DF on everything we send so oversized probes are dropped instead
+// of fragmented, returns false if unsupported
+inline bool enable_pmtu_probing(int sockfd)
+{
+#ifdef IP_MTU_DISCOVER
+    int val = IP_PMTUDISC_PROBE;
+    return setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) == 0;
+#else
+    return false;
+#endif
+}
+
+// packetization layer path MTU discovery (RFC 4821/8899 style):
+// start at DEFAULT_MSS, climb PROBE_SIZES while probes are acked, and
+// binary search between the last good and first bad size once one fails
+class Pmtu
+{
+public:
+    Pmtu(uint16_t max_mss)
+    {
+        m_mss = DEFAULT_MSS;
+        m_max_mss = max_mss;
+        m_bad_size = 0;
+        m_probe_size = 0;
+        m_fails = 0;
+        m_outstanding = false;
+    }
+
+    uint16_t mss() const
+    {
+        return m_mss;
+    }
+
+    // back to DEFAULT_MSS with everything learned forgotten, for a black
+    // hole (RFC 8899 section 4.3) or a path that is not the one searched
+    void restart()
+    {
+        *this = Pmtu(m_max_mss);
+    }
+
+    // when an outstanding probe counts as lost, 0 if none is in flight
+    uint64_t deadline() const
+    {
+        return m_outstanding ? m_deadline : 0;
+    }
+
+    // next size worth probing, or 0 if the search is over or a probe is in flight
+    uint16_t probe_due(uint64_t now)
+    {
+        check_timeout(now);
+        if (m_outstanding)
+            return 0;
+
+        if (m_bad_size == 0)
+        {
+            for (uint16_t size : PROBE_SIZES)
+            {
+                if (size > m_mss && size <= m_max_mss)
+                    return size;
+            }
+            if (m_max_mss > m_mss)
+                return m_max_mss;
+            return 0;
+        }
+
+        if (m_bad_size - m_mss <= PROBE_RESOLUTION)
+            return 0;
+        return m_mss + (m_bad_size - m_mss) / 2;
+    }
+
+    void probe_sent(uint16_t size, uint64_t now)
+    {
+        if (size != m_probe_size)
+            m_fails = 0;
+        m_probe_size = size;
+        m_outstanding = true;
+        m_deadline = now + PROBE_TIMEOUT * 1000ULL;
+    }
+
+    // the local interface refused the size outright
+    void probe_too_big(uint16_t size)
+    {
+        m_outstanding = false;
+        m_fails = 0;
+        m_bad_size = size;
+    }
+
+    // returns true if the segment size grew
+    bool probe_acked(uint16_t size)
+    {
+        if (!m_outstanding || size != m_probe_size)
+            return false;
+
+        m_outstanding = false;
+        m_fails = 0;
+        if (size <= m_mss)
+            return false;
+        m_mss = size;
+        return true;
+    }
+
+private:
+    void check_timeout(uint64_t now)
+    {
+        if (!m_outstanding || now < m_deadline)
+            return;
+
+        m_outstanding = false;
+        m_fails++;
+        if (m_fails >= MAX_PROBES)
+        {
+            m_fails = 0;
+            m_bad_size = m_probe_size;
+        }
+    }
+
+    uint16_t       m_mss;
+    uint16_t       m_max_mss;
+    uint16_t       m_bad_size; // smallest size known not to fit, 0 if none yet
+    uint16_t       m_probe_size;
+    uint16_t       m_fails;
+    bool           m_outstanding;
+    uint64_t       m_deadline; // microseconds
+};
+#endif
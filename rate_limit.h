@@ -0,0 +1,144 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include "packet.h"
+#include <map> // for map
+#include <vector> // for vector
+#include <algorithm> // for min, max
+
+const uint64_t RATE_BURST_US = 20000; // us of traffic a bucket can save up
+const uint64_t MIN_RATE_BURST = 2 * sizeof(Packet); // bytes, enough for a probe on a slow limit
+
+// token bucket: refills at rate bytes per second up to its burst, and a
+// datagram may go out whenever the balance is not negative, so a limit
+// never holds back a packet bigger than the burst forever
+class Token_bucket
+{
+public:
+    // rate of 0 means unlimited
+    Token_bucket(uint64_t rate = 0)
+    {
+        set_rate(rate);
+    }
+
+    void set_rate(uint64_t rate)
+    {
+        m_rate = rate;
+        m_burst = std::max(rate * RATE_BURST_US / 1000000, MIN_RATE_BURST);
+        m_tokens = m_burst;
+        m_last = 0;
+    }
+
+    bool limited() const
+    {
+        return m_rate != 0;
+    }
+
+    bool ready(uint64_t now)
+    {
+        refill(now);
+        return m_rate == 0 || m_tokens >= 0;
+    }
+
+    void consume(size_t bytes, uint64_t now)
+    {
+        refill(now);
+        if (m_rate != 0)
+            m_tokens -= bytes;
+    }
+
+    // when ready() turns true again, now if it already is
+    uint64_t ready_at(uint64_t now)
+    {
+        refill(now);
+        if (m_rate == 0 || m_tokens >= 0)
+            return now;
+        return now + (uint64_t) (-m_tokens * 1000000 / m_rate) + 1;
+    }
+
+private:
+    void refill(uint64_t now)
+    {
+        if (now > m_last)
+        {
+            m_tokens = std::min(m_burst, m_tokens + (double) (now - m_last) * m_rate / 1000000);
+            m_last = now;
+        }
+    }
+
+    uint64_t m_rate; // bytes per second
+    double   m_burst;
+    double   m_tokens; // bytes, negative after overdrawing with a large datagram
+    uint64_t m_last; // us, time the balance was last brought up to date
+};
+
+// weighted fair queuing between flows, in the start-time fair queuing
+// form: every flow carries the virtual time its next datagram may start
+// at, the scheduler always serves the smallest one, and serving len bytes
+// pushes that flow on by len / weight, so over any busy period each flow
+// gets bandwidth in proportion to its weight whatever its cwnd
+class Fair_scheduler
+{
+public:
+    Fair_scheduler()
+    {
+        m_virtual = 0;
+    }
+
+    void add(uint32_t id, uint32_t weight)
+    {
+        Tag tag;
+        tag.weight = std::max(weight, (uint32_t) 1);
+        tag.finish = m_virtual;
+        m_flows[id] = tag;
+    }
+
+    void remove(uint32_t id)
+    {
+        m_flows.erase(id);
+    }
+
+    // the candidate due first, false if there are none
+    bool pick(const std::vector<uint32_t> &candidates, uint32_t &id) const
+    {
+        bool found = false;
+        double best = 0;
+        for (uint32_t candidate : candidates)
+        {
+            auto i = m_flows.find(candidate);
+            if (i == m_flows.end())
+                continue;
+            double start = std::max(m_virtual, i->second.finish);
+            if (!found || start < best)
+            {
+                found = true;
+                best = start;
+                id = candidate;
+            }
+        }
+        return found;
+    }
+
+    // a flow coming back from idle starts at the current virtual time, so
+    // it cannot save up a share it did not use
+    void charge(uint32_t id, size_t bytes)
+    {
+        auto i = m_flows.find(id);
+        if (i == m_flows.end())
+            return;
+        double start = std::max(m_virtual, i->second.finish);
+        i->second.finish = start + (double) bytes / i->second.weight;
+        m_virtual = start;
+    }
+
+private:
+    struct Tag
+    {
+        uint32_t weight;
+        double   finish; // virtual time the flow's last datagram ends at
+    };
+
+    std::map<uint32_t, Tag> m_flows;
+    double                  m_virtual; // start tag of the datagram last served
+};
+#endif
@@ -0,0 +1,165 @@
+#ifndef REASSEMBLY_H
+#define REASSEMBLY_H
+
+#include "packet.h"
+#include <cstring> // for memcpy
+#include <vector> // for vector
+#include <algorithm> // for min
+
+const size_t RING_SIZE = MSN; // bytes, a full window plus as much again waiting to be read
+
+// receive side ring buffer: each segment is copied once, straight to the
+// place its sequence number maps to, and a bitmap of received bytes marks
+// the holes, so delivering in order is just moving base_num forward
+class Reassembly_buffer
+{
+public:
+    Reassembly_buffer()
+    {
+        m_ring.resize(RING_SIZE);
+        m_bits.resize((RING_SIZE + 63) / 64);
+        reset(0);
+    }
+
+    // next sequence number expected is base_num, nothing buffered
+    void reset(uint16_t base_num)
+    {
+        m_base_num = base_num % MSN;
+        m_base_off = 0;
+        m_read_off = 0;
+        std::fill(m_bits.begin(), m_bits.end(), 0);
+    }
+
+    uint16_t base_num() const
+    {
+        return m_base_num;
+    }
+
+    // true if seq_num is in the window and not buffered yet
+    bool wanted(uint16_t seq_num) const
+    {
+        uint16_t dist = (seq_num + MSN - m_base_num) % MSN;
+        return dist <= MSN/2 && !test((m_base_off + dist) % RING_SIZE);
+    }
+
+    // copies the segment to its offset, returns false if it is outside the
+    // window or would overwrite bytes the application has not read yet
+    bool insert(uint16_t seq_num, const char *data, size_t len)
+    {
+        uint16_t dist = (seq_num + MSN - m_base_num) % MSN;
+        if (dist > MSN/2)
+            return false;
+        uint64_t off = m_base_off + dist;
+        if (off + len - m_read_off > RING_SIZE)
+            return false;
+
+        size_t index = off % RING_SIZE;
+        size_t first = std::min(len, RING_SIZE - index);
+        memcpy(&m_ring[index], data, first);
+        memcpy(&m_ring[0], data + first, len - first);
+        set_range(index, len);
+
+        // deliver whatever is now contiguous
+        size_t run = contiguous(m_base_off % RING_SIZE, RING_SIZE - readable());
+        clear_range(m_base_off % RING_SIZE, run);
+        m_base_off += run;
+        m_base_num = (m_base_num + run) % MSN;
+        return true;
+    }
+
+    // end of file and FIN take up a sequence number but no buffer space
+    void skip(uint16_t n)
+    {
+        m_base_num = (m_base_num + n) % MSN;
+    }
+
+    size_t readable() const
+    {
+        return m_base_off - m_read_off;
+    }
+
+    // bytes past base_num that fit before unread ones would be overwritten
+    size_t space() const
+    {
+        return RING_SIZE - readable();
+    }
+
+    // in-order bytes that sit contiguously in the ring, without copying,
+    // starting skip bytes past the first unread one
+    size_t peek(const char *&data, size_t skip = 0) const
+    {
+        if (skip >= readable())
+            return 0;
+        size_t index = (m_read_off + skip) % RING_SIZE;
+        data = &m_ring[index];
+        return std::min(readable() - skip, RING_SIZE - index);
+    }
+
+    void consume(size_t len)
+    {
+        m_read_off += std::min(len, readable());
+    }
+
+private:
+    bool test(size_t index) const
+    {
+        return (m_bits[index / 64] >> (index % 64)) & 1;
+    }
+
+    void set_range(size_t index, size_t len)
+    {
+        for (; len != 0; len--, index = (index + 1) % RING_SIZE)
+        {
+            if (index % 64 == 0 && len >= 64 && index + 64 <= RING_SIZE)
+            {
+                m_bits[index / 64] = ~0ULL;
+                len -= 63;
+                index += 63;
+                continue;
+            }
+            m_bits[index / 64] |= 1ULL << (index % 64);
+        }
+    }
+
+    void clear_range(size_t index, size_t len)
+    {
+        for (; len != 0; len--, index = (index + 1) % RING_SIZE)
+        {
+            if (index % 64 == 0 && len >= 64 && index + 64 <= RING_SIZE)
+            {
+                m_bits[index / 64] = 0;
+                len -= 63;
+                index += 63;
+                continue;
+            }
+            m_bits[index / 64] &= ~(1ULL << (index % 64));
+        }
+    }
+
+    // received bytes in a row starting at index, up to max
+    size_t contiguous(size_t index, size_t max) const
+    {
+        size_t run = 0;
+        while (run < max)
+        {
+            if (index % 64 == 0 && max - run >= 64 && index + 64 <= RING_SIZE && m_bits[index / 64] == ~0ULL)
+            {
+                run += 64;
+                index = (index + 64) % RING_SIZE;
+                continue;
+            }
+            if (!test(index))
+                break;
+            run++;
+            index = (index + 1) % RING_SIZE;
+        }
+        return run;
+    }
+
+    std::vector<char>     m_ring;
+    std::vector<uint64_t> m_bits; // one bit per ring byte, set once received
+    uint16_t              m_base_num; // first sequence number not yet received
+    uint64_t              m_base_off; // stream offset of base_num
+    uint64_t              m_read_off; // stream offset the application has read up to
+};
+#endif
@@ -1,4 +1,11 @@
-#include "packet.h"
+#include "server_connection.h"
+#include "udp_offload.h"
+#include "pmtu.h"
+#include "cookie.h"
+#include "sync.h"
+#include "uring.h"
+#include "rate_limit.h"
+#include "path_cache.h"
 #include <cstring> // for memset
 #include <iostream> // for cout
 #include <stdio.h> // for perror
@@ -9,413 +16,916 @@
 #include <sys/stat.h> // for open
 #include <fcntl.h> // for open
 #include <unistd.h> // for close, read
-#include <unordered_map> // for map
-#include <sys/time.h> // for socket timeout
-#include <cmath> // for floor
-#include <signal.h> // for SIG_INT detection
+#include <vector> // for vector
+#include <sys/epoll.h> // for epoll_wait
+#include <ctime> // for time
 #include <fstream> // for ifstream
+#include <sstream> // for istringstream
 #include <errno.h>
+#include <getopt.h> // for getopt
+#include <arpa/inet.h> // for inet_ntop
+#include <map> // for map
+#include <cstdlib> // for strtoull
+#include <memory> // for unique_ptr
+#include <algorithm> // for find
 
 using namespace std;
 
-uint16_t update_window(const Packet &p, unordered_map<uint16_t, Packet_info> &window, uint16_t &base_num, RTO &rto);
-struct timeval time_left(unordered_map<uint16_t, Packet_info> &window, uint16_t base_num);
-void process_recv(int n_bytes, const string &function, int sockfd, Packet_info &last_ack, struct sockaddr_storage recv_addr, socklen_t addr_len, const RTO &rto);
+const size_t READ_CHUNK = 16384; // bytes read from a file per write into the connection
+const uint32_t MAX_FLOWS = 32; // connections served at once, later SYNs wait for a free one
+const uint16_t URING_ENTRIES = 256; // submission queue size
+const uint16_t URING_RECVS = 16; // datagram receives kept posted
+const uint16_t URING_SENDS = 64; // datagrams in flight to the kernel at once
+const uint16_t URING_READS = 2; // registered file buffers per connection, one filling while one drains
+
+// one of a connection's io_uring file buffers, the memory itself is in
+// the registered pool
+struct Read_buffer
+{
+    size_t len;
+    size_t pos;
+    bool   reading;
+};
+
+// where the response to the current request comes from
+struct Response
+{
+    ifstream      file;
+    istringstream generated; // sync manifests and chunk replies
+    Chunk_index   chunk_index; // chunks of the last manifest sent
+    istream      *source; // NULL once all of it is in the connection
+    int           fd; // plain file read through io_uring instead, -1 if none
+    Read_buffer   reads[URING_READS];
+    uint64_t      read_offset;
+    bool          read_eof;
+    uint16_t      next_read; // buffer the next read goes into
+    uint16_t      next_feed; // buffer the connection takes from next
+};
+
+// a client and everything kept for it
+struct Flow
+{
+    Flow(uint16_t isn, uint64_t cookie, bool probing, uint32_t conn_id) : conn(isn, cookie, probing, conn_id)
+    {
+    }
+
+    Server_connection       conn;
+    uint32_t                conn_id;
+    string                  syn_key; // address the SYN came from, resent SYNs too
+    struct sockaddr_storage addr; // where datagrams go, the last address that answered a challenge
+    socklen_t               addr_len;
+    struct sockaddr_storage challenge_addr; // where path challenges go, the address being validated
+    socklen_t               challenge_addr_len; // 0 if none is
+    Response                response;
+    Token_bucket            bucket;
+    uint32_t                sends; // io_uring sendmsgs not completed yet, their slots name this flow
+};
+
+// the connections being served and the limits they share
+struct Server
+{
+    int                      sockfd;
+    string                   root;
+    uint8_t                  cookie_key[KEY_LEN];
+    bool                     probing;
+    uint64_t                 flow_rate; // bytes per second for each connection, 0 for no limit
+    map<string, uint32_t>    weights; // fair share by client IP, 1 if not listed
+    uint32_t                 accepts_left; // connections still to take, 0 for no limit
+    bool                     unlimited;
+    bool                     failed;
+    vector<unique_ptr<Flow>> flows; // MAX_FLOWS slots, the index is the flow's id
+    map<uint32_t, uint32_t>  by_conn_id; // everything after the SYN
+    map<string, uint32_t>    by_addr; // SYNs, which carry no connection ID yet
+    uint64_t                 nonce_base;
+    uint64_t                 nonces; // handed out so far
+    Token_bucket             bucket; // every connection together
+    Fair_scheduler           scheduler;
+    Path_cache               paths;
+    Chunk_cache              chunks; // of files listed in manifests
+};
+
 void process_error(int status, const string &function);
-bool valid_ack(const Packet &p, uint16_t base_num);
-int open_file(char* file);
+bool parse_weight(const string &arg, map<string, uint32_t> &weights);
+string addr_key(const struct sockaddr_storage &addr, socklen_t addr_len);
+string peer_ip(const struct sockaddr_storage &addr);
+uint64_t nonce(Server &server);
+Flow *flow_for(Server &server, const char *buf, size_t len, const struct sockaddr_storage &addr, socklen_t addr_len);
+bool done(const Server &server);
+void service(Server &server, bool direct, vector<char> &chunk);
+void reap(Server &server, uint32_t id);
+template <typename Send> uint64_t schedule(Server &server, uint64_t now, Send send);
+void handle_events(Flow &flow, Server &server, bool direct);
+void feed(Server_connection &conn, Response &response, vector<char> &chunk);
+void serve_epoll(Server &server, bool gso);
+#ifdef HAVE_IO_URING
+void serve_uring(Uring &ring, Server &server);
+#endif
+void send_transmit(int sockfd, const Transmit &t, Server_connection &conn, Gso_batch *batch, const struct sockaddr_storage &addr, socklen_t addr_len);
+string request_path(const string &root, const string &name);
+bool open_file(const string &root, const string &name, ifstream &file);
+istream *open_request(const string &root, const string &name, ifstream &file, istringstream &generated, Chunk_index &index, Chunk_cache &cache);
 int set_up_socket(char* port);
 
 int main(int argc, char* argv[])
 {
-    if (argc != 3)
+    Server server;
+    server.flow_rate = 0;
+    server.accepts_left = 1;
+    server.failed = false;
+    bool gso = false;
+    bool uring = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "gur:R:w:n:")) != -1)
     {
-        cout << "Usage: " << argv[0] << " PORT-NUMBER FILE-NAME" << endl;
-        exit(1);
+        if (opt == 'g')
+        {
+            gso = true;
+        }
+        else if (opt == 'u')
+        {
+            uring = true;
+        }
+        else if (opt == 'r')
+        {
+            server.flow_rate = strtoull(optarg, NULL, 10) * 1024;
+        }
+        else if (opt == 'R')
+        {
+            server.bucket.set_rate(strtoull(optarg, NULL, 10) * 1024);
+        }
+        else if (opt == 'n')
+        {
+            server.accepts_left = strtoul(optarg, NULL, 10);
+        }
+        else if (opt != 'w' || !parse_weight(optarg, server.weights))
+        {
+            optind = argc + 1; // force usage message
+            break;
+        }
     }
 
-    ifstream file(argv[2]);
-    int sockfd = set_up_socket(argv[1]);
-    struct sockaddr_storage recv_addr;
-    socklen_t addr_len = sizeof(recv_addr);
-    int status, n_bytes;
-    uint16_t ack_num, base_num;
-    Packet p;
-
-    unordered_map<uint16_t, Packet_info> window;
-    Packet_info pkt_info;
+    if (argc - optind != 2)
+    {
+        cout << "Usage: " << argv[0] << " [-g] [-u] [-r KB/S] [-R KB/S] [-w IP=WEIGHT]... [-n CONNECTIONS] PORT-NUMBER FILE-OR-DIRECTORY" << endl;
+        exit(1);
+    }
 
-    // select random seq_num
+    server.root = argv[optind + 1];
+    server.unlimited = server.accepts_left == 0;
+    server.flows.resize(MAX_FLOWS);
+    server.nonce_base = now_us() ^ ((uint64_t) getpid() << 32);
+    server.nonces = 0;
+    if (!load_cookie_key(server.cookie_key))
+    {
+        cerr << "could not load or create " << COOKIE_KEY_FILE << endl;
+        exit(1);
+    }
+    server.sockfd = set_up_socket(argv[optind]);
+    if (gso && !gso_supported(server.sockfd))
+    {
+        cerr << "UDP_SEGMENT not supported, sending one datagram per packet" << endl;
+        gso = false;
+    }
+    server.probing = enable_pmtu_probing(server.sockfd);
+    server.paths.load(PATH_CACHE_FILE, time(NULL));
     srand(time(NULL));
-    uint16_t seq_num = rand() % MSN;
 
-    RTO rto;
+    bool served = false;
+    if (uring)
+    {
+#ifdef HAVE_IO_URING
+        Uring ring;
+        if (ring.init(URING_ENTRIES))
+        {
+            if (gso)
+                cerr << "UDP_SEGMENT is not used with io_uring, sending one datagram per packet" << endl;
+            serve_uring(ring, server);
+            served = true;
+        }
+#endif
+        if (!served)
+            cerr << "io_uring not available, using epoll" << endl;
+    }
+    if (!served)
+    {
+        serve_epoll(server, gso);
+    }
+    close(server.sockfd);
+    return server.failed ? 1 : 0;
+}
 
-    // recv SYN from client
-    do
+// "10.0.0.7=4" gives that client four times the share of a weight 1 one
+bool parse_weight(const string &arg, map<string, uint32_t> &weights)
+{
+    size_t equals = arg.find('=');
+    if (equals == string::npos || strtoul(arg.c_str() + equals + 1, NULL, 10) == 0)
     {
-        n_bytes = recvfrom(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, &addr_len);
-        process_error(n_bytes, "recv SYN");
-    } while (!p.syn_set());
-    cout << "Receiving packet " << p.ack_num() << endl;
-    ack_num = (p.seq_num() + 1) % MSN;
-
-    // sending SYN ACK
-    p = Packet(1, 1, 0, seq_num, ack_num, 0, "", 0);
-    pkt_info = Packet_info(p, n_bytes - HEADER_LEN, rto.get_timeout());
-    status = sendto(sockfd, (void *) &p, HEADER_LEN, 0, (struct sockaddr *) &recv_addr, addr_len);
-    process_error(status, "sending SYN ACK");
-    cout << "Sending packet " << seq_num << " " << MSS << " " << INITIAL_SSTHRESH << " SYN" << endl;
-    seq_num = (seq_num + 1) % MSN;
-    base_num = seq_num;
-
-    // recv ACK
-    do
+        return false;
+    }
+    weights[arg.substr(0, equals)] = strtoul(arg.c_str() + equals + 1, NULL, 10);
+    return true;
+}
+
+string addr_key(const struct sockaddr_storage &addr, socklen_t addr_len)
+{
+    return string((const char *) &addr, addr_len);
+}
+
+string peer_ip(const struct sockaddr_storage &addr)
+{
+    char host[INET6_ADDRSTRLEN] = "";
+    if (addr.ss_family == AF_INET)
+        inet_ntop(AF_INET, &((const struct sockaddr_in *) &addr)->sin_addr, host, sizeof(host));
+    else if (addr.ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *) &addr)->sin6_addr, host, sizeof(host));
+    return host;
+}
+
+// connection IDs and path challenges are keyed hashes of a counter, so
+// nobody off the path can guess one
+uint64_t nonce(Server &server)
+{
+    uint64_t input[2] = {server.nonce_base, server.nonces++};
+    return siphash(server.cookie_key, (const uint8_t *) input, sizeof(input));
+}
+
+// the connection a datagram belongs to, set up if it is a new client's
+// SYN, NULL if it is to be dropped
+Flow *flow_for(Server &server, const char *buf, size_t len, const struct sockaddr_storage &addr, socklen_t addr_len)
+{
+    const Packet *p = (const Packet *) buf;
+    if (len < HEADER_LEN)
     {
-        struct timeval max_time = pkt_info.get_max_time();
-        struct timeval curr_time;
-        gettimeofday(&curr_time, NULL);
-        struct timeval time_left;
-        timersub(&max_time, &curr_time, &time_left);
-        status = setsockopt(sockfd, SOL_SOCKET,SO_RCVTIMEO, (char *)&time_left, sizeof(time_left));
-        process_error(status, "setsockopt");
-        n_bytes = recvfrom(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, &addr_len);
-        process_recv(n_bytes, "recv ACK after SYN ACK", sockfd, pkt_info, recv_addr, addr_len, rto);
-    } while (p.seq_num() != ack_num); // discard invalid ack
-    uint16_t prev_ack = p.ack_num();
-    cout << "Receiving packet " << p.ack_num() << endl;
-    ack_num = (p.seq_num() + 1) % MSN;
-
-    double cwnd = min((double) MSS, MSN / 2.0);
-    uint16_t cwnd_used = 0;
-    uint16_t ssthresh = INITIAL_SSTHRESH;
-    uint16_t cwd_pkts = 0;
-    uint16_t pkts_sent = 0;
-    uint16_t dup_ack = 0;
-    uint16_t recv_window = UINT16_MAX;
-    bool slow_start = true;
-    bool congestion_avoidance = false;
-    bool fast_recovery = false;
-    bool retransmission = false;
-    bool last_retransmit = false;
-    // send file
-    do
+        return NULL;
+    }
+    if (p->conn_id() != 0)
     {
-        if (retransmission) // retransmit missing segment
+        auto known = server.by_conn_id.find(p->conn_id());
+        if (known == server.by_conn_id.end())
         {
-            auto found = window.find(base_num);
-            p = found->second.pkt();
-            status = sendto(sockfd, (void *) &p, found->second.data_len() + HEADER_LEN, 0, (struct sockaddr *) &recv_addr, addr_len);
-            process_error(status, "sending retransmission");
-            cout << "Sending packet " << p.seq_num() << " " << cwnd << " " << ssthresh << " Retransmission" << endl;
-            retransmission = false;
-
-            if (last_retransmit)
-            {
-                // double RTO if retransmission again
-                rto.double_RTO();
-            }
-            found->second.update_time(rto.get_timeout());
-            last_retransmit = true;
+            return NULL;
         }
-        else // transmit new segment(s), as allowed
+        Flow *flow = server.flows[known->second].get();
+        string key = addr_key(addr, addr_len);
+        if (key == addr_key(flow->addr, flow->addr_len))
         {
-            last_retransmit = false;
-            while (floor(cwnd) - cwnd_used >= MSS && !file.eof())
-            {
-                string data;
-                size_t buf_pos = 0;
-                data.resize(MSS);
-
-                cout << "Sending packet " << seq_num << " " << cwnd << " " << ssthresh << endl;
-                // make sure recv all that we can
-                do
-                {
-                    size_t n_to_send = (size_t) min(cwnd - cwnd_used, (double) min(MSS, recv_window));
-                    file.read(&data[buf_pos], n_to_send);
-                    n_bytes = file.gcount();
-                    buf_pos += n_bytes;
-                    cwnd_used += n_bytes;
-                } while (cwnd_used < floor(cwnd) && !file.eof() && buf_pos != MSS);
-
-                // send packet
-                p = Packet(0, 0, 0, seq_num, ack_num, 0, data.c_str(), buf_pos);
-                pkt_info = Packet_info(p, buf_pos, rto.get_timeout());
-                status = sendto(sockfd, (void *) &p, buf_pos + HEADER_LEN, 0, (struct sockaddr *) &recv_addr, addr_len);
-                process_error(status, "sending packet");
-                window.emplace(seq_num, pkt_info);
-                seq_num = (seq_num + pkt_info.data_len()) % MSN;
-            }
+            return flow;
         }
-
-        // recv ACK
-        do
+        if (flow->challenge_addr_len != 0 && key == addr_key(flow->challenge_addr, flow->challenge_addr_len))
         {
-            struct timeval time_left_tv= time_left(window, base_num);
-            status = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&time_left_tv, sizeof(time_left_tv));
-            process_error(status, "setsockopt");
-            int ack_n_bytes = recvfrom(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, &addr_len);
-            if (ack_n_bytes == -1) //error
-            {
-                // check if timed out
-                if (errno == EAGAIN || EWOULDBLOCK || EINPROGRESS)
-                {
-                    // adjust cwnd and ssthresh
-                    ssthresh = cwnd / 2;
-                    cwnd = MSS;
-                    dup_ack = 0;
-                    slow_start = true;
-                    congestion_avoidance = false;
-                    fast_recovery = false;
-                    retransmission = true;
-                    break;
-                }
-                else // else another error and process it
-                {
-                    process_error(ack_n_bytes, "recv ACK after sending data");
-                }
-            }
-        } while (!valid_ack(p, base_num));
-        if (retransmission)
-            continue;
+            return flow; // its ACKs count, it just gets no data until it answers
+        }
 
-        cout << "Receiving packet " << p.ack_num() << endl;
-        if (prev_ack == p.ack_num()) // if duplicate
+        // the client may have moved (NAT rebinding, another interface):
+        // challenge the new address and keep sending to the old one until
+        // EVENT_PATH_VALIDATED
+        bool same_host = peer_ip(addr) == peer_ip(flow->addr);
+        if (!flow->conn.on_path_change(buf, len, nonce(server), same_host, now_us()))
         {
-            if (fast_recovery)
-            {
-                cwnd += MSS;
-            }
-            else
-            {
-                dup_ack++;
-            }
-
-            // if retransmit
-            if (dup_ack == 3)
-            {
-                ssthresh = cwnd / 2;
-                cwnd = ssthresh + 3 * MSS;
-                fast_recovery = true;
-                slow_start = false;
-                congestion_avoidance = false;
-                retransmission = true;
-                dup_ack = 0;
-            }
+            return NULL; // older than what came already
         }
-        else // new ack
-        {
-            if (slow_start)
-            {
-                cwnd += MSS;
-                dup_ack = 0;
+        flow->challenge_addr = addr;
+        flow->challenge_addr_len = addr_len;
+        return flow;
+    }
 
-                if (cwnd >= ssthresh)
-                {
-                    slow_start = false;
-                    congestion_avoidance = true;
-                    cwd_pkts = cwnd / MSS;
-                    pkts_sent = 0;
-                }
-            }
-            else if (congestion_avoidance)
-            {
-                if (pkts_sent == cwd_pkts)
-                {
-                    cwd_pkts = cwnd / MSS;
-                    pkts_sent = 0;
-                }
-                cwnd += MSS / (double) cwd_pkts;
-                pkts_sent++;
-            }
-            else // fast recovery
-            {
-                cwnd = ssthresh;
-                dup_ack = 0;
-                fast_recovery = false;
-                congestion_avoidance = true;
-            }
+    auto known = server.by_addr.find(addr_key(addr, addr_len));
+    if (known != server.by_addr.end())
+    {
+        return server.flows[known->second].get();
+    }
+    if (!p->syn_set() || (!server.unlimited && server.accepts_left == 0))
+    {
+        return NULL;
+    }
+    uint32_t id = 0;
+    while (id < MAX_FLOWS && server.flows[id])
+    {
+        id++;
+    }
+    if (id == MAX_FLOWS)
+    {
+        return NULL; // full, the client resends its SYN
+    }
 
-            prev_ack = p.ack_num();
-            cwnd_used -= update_window(p, window, base_num, rto);
-            ack_num = (p.seq_num() + 1) % MSN;
-        }
+    // select random seq_num, and a connection ID no other flow has
+    uint32_t conn_id;
+    do
+    {
+        conn_id = nonce(server);
+    } while (conn_id == 0 || server.by_conn_id.count(conn_id) != 0);
+    Flow *flow = new Flow(rand() % MSN, make_cookie(server.cookie_key, addr), server.probing, conn_id);
+    server.flows[id].reset(flow);
+    flow->conn_id = conn_id;
+    flow->syn_key = addr_key(addr, addr_len);
+    server.by_conn_id[conn_id] = id;
+    server.by_addr[flow->syn_key] = id;
+    server.accepts_left--;
+    flow->addr = addr;
+    flow->addr_len = addr_len;
+    flow->challenge_addr_len = 0;
+    flow->sends = 0;
+    flow->conn.set_log(&cout);
+    flow->bucket.set_rate(server.flow_rate);
+    flow->response.source = NULL;
+    flow->response.fd = -1;
+    flow->response.read_offset = 0;
+    flow->response.read_eof = false;
+    flow->response.next_read = flow->response.next_feed = 0;
+    for (Read_buffer &b : flow->response.reads)
+    {
+        b.len = b.pos = 0;
+        b.reading = false;
+    }
 
-        cwnd = min(cwnd, MSN / 2.0); // make sure cwnd is not greater than MSN/2
-        cwnd = max(cwnd, (double) MSS); // make sure cwnd is not less than MSS
-        ssthresh = max(ssthresh, MSS); // make sure ssthresh is at least MSS
+    auto weight = server.weights.find(peer_ip(addr));
+    server.scheduler.add(id, weight != server.weights.end() ? weight->second : 1);
 
-        recv_window = p.recv_window();
-    } while (!file.eof() || (window.size() != 0));
+    // start where the last connection from this client left off
+    Path_metrics metrics;
+    if (server.paths.lookup(peer_ip(addr), time(NULL), metrics))
+        flow->conn.seed_path(metrics);
+    return flow;
+}
 
-    // send FIN
-    p = Packet(0, 0, 1, seq_num, ack_num, 0, "", 0);
-    pkt_info = Packet_info(p, 0, rto.get_timeout());
-    status = sendto(sockfd, (void *) &p, HEADER_LEN, 0, (struct sockaddr *) &recv_addr, addr_len);
-    process_error(status, "sending FIN");
-    cout << "Sending packet " << seq_num << " FIN" << endl;
-    seq_num = (seq_num + 1) % MSN;
+bool done(const Server &server)
+{
+    if (server.unlimited || server.accepts_left != 0)
+    {
+        return false;
+    }
+    for (const unique_ptr<Flow> &flow : server.flows)
+    {
+        if (flow)
+            return false;
+    }
+    return true;
+}
 
-    // recv FIN ACK
-    do
+// timers, requests and response data for every connection
+void service(Server &server, bool direct, vector<char> &chunk)
+{
+    uint64_t now = now_us();
+    for (const unique_ptr<Flow> &flow : server.flows)
     {
-        struct timeval max_time = pkt_info.get_max_time();
-        struct timeval curr_time;
-        gettimeofday(&curr_time, NULL);
-        struct timeval time_left;
-        timersub(&max_time, &curr_time, &time_left);
-        status = setsockopt(sockfd, SOL_SOCKET,SO_RCVTIMEO, (char *)&time_left, sizeof(time_left));
-        process_error(status, "setsockopt");
-        n_bytes = recvfrom(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, &addr_len);
-        process_recv(n_bytes, "recv FIN ACK", sockfd, pkt_info, recv_addr, addr_len, rto);
-    } while (!p.fin_set() || !p.ack_set());
-    prev_ack = p.ack_num();
-    cout << "Receiving packet " << p.ack_num() << endl;
-    ack_num = (p.seq_num() + 1) % MSN;
-
-    // send ACK after FIN ACK
-    p = Packet(0, 1, 0, seq_num, ack_num, 0, "", 0);
-    pkt_info = Packet_info(p, 0, rto.get_timeout());
-    status = sendto(sockfd, (void *) &p, HEADER_LEN, 0, (struct sockaddr *) &recv_addr, addr_len);
-    process_error(status, "sending ACK after FIN ACK");
-    cout << "Sending packet " << seq_num << endl;
-
-    // make sure client receives ACK after FIN ACK
-    do
+        if (!flow)
+            continue;
+        flow->conn.on_timeout(now);
+        handle_events(*flow, server, direct);
+        feed(flow->conn, flow->response, chunk);
+    }
+}
+
+void reap(Server &server, uint32_t id)
+{
+    Flow &flow = *server.flows[id];
+    if (flow.response.fd != -1)
+    {
+        close(flow.response.fd);
+    }
+    Path_metrics metrics;
+    if (flow.conn.path_metrics(metrics, now_us()))
+    {
+        server.paths.update(peer_ip(flow.addr), time(NULL), metrics);
+        if (!server.paths.save(PATH_CACHE_FILE))
+            cerr << "could not save " << PATH_CACHE_FILE << endl;
+    }
+    server.by_conn_id.erase(flow.conn_id);
+    server.by_addr.erase(flow.syn_key);
+    server.scheduler.remove(id);
+    server.flows[id].reset();
+}
+
+// hands send() datagrams from the connections in fair order until each is
+// out of cwnd or data or held back by a rate limit, or send() has no room
+// for more; returns when a limit that held something back lifts, 0 if none
+template <typename Send>
+uint64_t schedule(Server &server, uint64_t now, Send send)
+{
+    vector<uint32_t> ready;
+    for (uint32_t id = 0; id < MAX_FLOWS; id++)
+    {
+        if (server.flows[id] && !server.flows[id]->conn.closed())
+            ready.push_back(id);
+    }
+
+    uint64_t wake = 0;
+    Transmit t;
+    uint32_t id;
+    while (server.scheduler.pick(ready, id))
+    {
+        if (!server.bucket.ready(now))
+        {
+            wake = server.bucket.ready_at(now);
+            break;
+        }
+        Flow &flow = *server.flows[id];
+        if (!flow.bucket.ready(now) || !flow.conn.poll_transmit(t, now))
+        {
+            if (!flow.bucket.ready(now))
+                wake = wake == 0 ? flow.bucket.ready_at(now) : min(wake, flow.bucket.ready_at(now));
+            ready.erase(find(ready.begin(), ready.end(), id));
+            continue;
+        }
+
+        flow.bucket.consume(t.len, now);
+        server.bucket.consume(t.len, now);
+        server.scheduler.charge(id, t.len);
+        if (!send(id, flow, t))
+            break;
+    }
+    return wake;
+}
+
+// requests in, and where each response is going to come from
+void handle_events(Flow &flow, Server &server, bool direct)
+{
+    Server_connection &conn = flow.conn;
+    Response &response = flow.response;
+    Event e;
+    while (conn.poll_event(e))
     {
-        struct timeval max_time = pkt_info.get_max_time();
-        struct timeval curr_time;
-        gettimeofday(&curr_time, NULL);
-        struct timeval time_left;
-        timersub(&max_time, &curr_time, &time_left);
-        time_left.tv_sec *= 2; // 2*RTO
-        time_left.tv_usec *= 2; // 2*RTO
-        status = setsockopt(sockfd, SOL_SOCKET,SO_RCVTIMEO, (char *)&time_left, sizeof(time_left));
-        process_error(status, "setsockopt");
-        n_bytes = recvfrom(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, &addr_len);
-        if (n_bytes == -1) //error
-        {
-            // check if timed out, if so everything is fine close
-            if (errno == EAGAIN || EWOULDBLOCK || EINPROGRESS)
+        if (e.type == EVENT_REQUEST)
+        {
+            response.source = open_request(server.root, e.name, response.file, response.generated, response.chunk_index, server.chunks);
+            if (response.source == NULL)
             {
-                break;
+                cerr << "could not open requested file \"" << e.name << "\", sending nothing" << endl;
+                conn.end_response();
             }
-            else // else another error and process it
+            else if (direct && response.source == &response.file)
             {
-                process_error(n_bytes, "checking to see if recv FIN ACK again");
+                // plain files are read by the kernel straight into our buffers
+                response.file.close();
+                response.source = NULL;
+                response.fd = open(request_path(server.root, e.name).c_str(), O_RDONLY);
+                if (response.fd == -1)
+                    conn.end_response();
             }
         }
-        else if (p.fin_set() && p.ack_set()) // if client send FIN ACK again, send ACK
+        else if (e.type == EVENT_PATH_VALIDATED)
+        {
+            // a new host starts from what the cache knows of it, if anything
+            Path_metrics metrics;
+            bool same_host = peer_ip(flow.challenge_addr) == peer_ip(flow.addr);
+            flow.addr = flow.challenge_addr;
+            flow.addr_len = flow.challenge_addr_len;
+            flow.challenge_addr_len = 0;
+            if (!same_host && server.paths.lookup(peer_ip(flow.addr), time(NULL), metrics))
+                conn.seed_path(metrics);
+        }
+        else if (e.type == EVENT_PATH_FAILED)
+        {
+            flow.challenge_addr_len = 0; // carry on as if it never turned up
+        }
+        else if (e.type == EVENT_TIMED_OUT)
+        {
+            // gone, or never there (a spoofed SYN): the slot is free again
+            cerr << "no answer from " << peer_ip(flow.addr) << ", connection dropped" << endl;
+        }
+        else if (e.type == EVENT_ERROR)
         {
-            pkt_info.update_time(rto.get_timeout());
-            p = pkt_info.pkt();
-            status = sendto(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, addr_len);
-            process_error(status, "sending packet");
+            // the connection is closed, the others carry on
+            cerr << e.name << endl;
+            server.failed = true;
         }
-    } while (!p.fin_set() || !p.ack_set());
+    }
 }
 
-void process_recv(int n_bytes, const string &function, int sockfd, Packet_info &last_ack, struct sockaddr_storage recv_addr, socklen_t addr_len, const RTO &rto)
+// response bytes for the current request into the connection
+void feed(Server_connection &conn, Response &response, vector<char> &chunk)
 {
-    if (n_bytes == -1) //error
+    while (response.source != NULL && conn.writable() != 0)
     {
-        // check if timed out
-        if (errno == EAGAIN || EWOULDBLOCK || EINPROGRESS)
+        response.source->read(&chunk[0], min(chunk.size(), conn.writable()));
+        conn.write(&chunk[0], response.source->gcount());
+        if (!response.source->good())
         {
-            last_ack.update_time(rto.get_timeout());
-            Packet p = last_ack.pkt();
-            int status = sendto(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, addr_len);
-            process_error(status, "sending packet");
-        }
-        else // else another error and process it
-        {
-            process_error(n_bytes, "checking to see if recv FIN ACK again");
+            conn.end_response();
+            response.source = NULL;
         }
     }
 }
 
-struct timeval time_left(unordered_map<uint16_t, Packet_info> &window, uint16_t base_num)
+void serve_epoll(Server &server, bool gso)
 {
-    auto first_pkt = window.find(base_num);
-    if (first_pkt == window.end())
+    int sockfd = server.sockfd;
+    int status = fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    process_error(status, "fcntl");
+    int epfd = epoll_create1(0);
+    process_error(epfd, "epoll_create1");
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    status = epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+    process_error(status, "epoll_ctl");
+
+    Gso_batch batch;
+    Packet p;
+    struct sockaddr_storage recv_addr;
+    socklen_t addr_len;
+    int n_bytes;
+    vector<char> chunk(READ_CHUNK);
+    while (!done(server))
     {
-        cerr << "could not find base_num packet " << base_num << " in window, in time_left function" << endl;
-        exit(1);
+        service(server, false, chunk);
+
+        // send everything the connections have ready, segmented if we can;
+        // a batch only ever holds one client's datagrams
+        uint64_t now = now_us();
+        Flow *batch_flow = NULL;
+        uint64_t wake = schedule(server, now, [&](uint32_t, Flow &flow, const Transmit &t)
+        {
+            if (batch_flow != NULL && batch_flow != &flow)
+            {
+                int status = batch.flush(sockfd, (const struct sockaddr *) &batch_flow->addr, batch_flow->addr_len);
+                process_error(status, "sending segmented packets");
+            }
+            if (t.challenge) // alone, the batch is for the validated address
+            {
+                send_transmit(sockfd, t, flow.conn, NULL, flow.challenge_addr, flow.challenge_addr_len);
+                return true;
+            }
+            batch_flow = &flow;
+            send_transmit(sockfd, t, flow.conn, gso ? &batch : NULL, flow.addr, flow.addr_len);
+            return true;
+        });
+        if (batch_flow != NULL)
+        {
+            status = batch.flush(sockfd, (const struct sockaddr *) &batch_flow->addr, batch_flow->addr_len);
+            process_error(status, "sending segmented packets");
+        }
+        for (uint32_t id = 0; id < MAX_FLOWS; id++)
+        {
+            if (server.flows[id] && server.flows[id]->conn.closed())
+                reap(server, id);
+        }
+        if (done(server))
+            break;
+
+        // wait for the next ACK, timer or rate limit
+        uint64_t deadline = wake;
+        for (const unique_ptr<Flow> &flow : server.flows)
+        {
+            if (flow && flow->conn.next_timeout() != 0 && (deadline == 0 || flow->conn.next_timeout() < deadline))
+                deadline = flow->conn.next_timeout();
+        }
+        int wait_ms = -1;
+        if (deadline != 0)
+        {
+            now = now_us();
+            wait_ms = deadline > now ? (deadline - now + 999) / 1000 : 0;
+        }
+        status = epoll_wait(epfd, &ev, 1, wait_ms);
+        if (status == -1 && errno != EINTR)
+            process_error(status, "epoll_wait");
+
+        addr_len = sizeof(recv_addr);
+        while ((n_bytes = recvfrom(sockfd, (void *) &p, sizeof(p), 0, (struct sockaddr *) &recv_addr, &addr_len)) != -1)
+        {
+            Flow *flow = flow_for(server, (const char *) &p, n_bytes, recv_addr, addr_len);
+            if (flow != NULL)
+                flow->conn.on_datagram((const char *) &p, n_bytes, now_us());
+            addr_len = sizeof(recv_addr);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            process_error(n_bytes, "recv ACK");
     }
-    struct timeval max_time = first_pkt->second.get_max_time();
+    close(epfd);
+}
 
-    struct timeval curr_time;
-    gettimeofday(&curr_time, NULL);
+#ifdef HAVE_IO_URING
+enum Uring_op
+{
+    OP_RECV,
+    OP_SEND,
+    OP_READ
+};
 
-    struct timeval time_left;
-    timersub(&max_time, &curr_time, &time_left);
+struct Uring_slot
+{
+    Transmit                t; // datagram received or being sent
+    struct sockaddr_storage addr; // where from or to
+    struct iovec            iov;
+    struct msghdr           msg;
+};
+
+// kind of operation, connection and slot, so a completion finds its way back
+uint64_t tag(Uring_op op, uint32_t id, uint16_t index)
+{
+    return ((uint64_t) op << 48) | ((uint64_t) id << 16) | index;
+}
 
-    return time_left;
+void post_recv(Uring &ring, int sockfd, Uring_slot &slot, uint16_t index)
+{
+    memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.iov.iov_base = &slot.t.pkt;
+    slot.iov.iov_len = sizeof(slot.t.pkt);
+    slot.msg.msg_name = &slot.addr;
+    slot.msg.msg_namelen = sizeof(slot.addr);
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+    ring.recvmsg(sockfd, &slot.msg, tag(OP_RECV, 0, index));
 }
 
-bool valid_ack(const Packet &p, uint16_t base_num)
+// hands file data over in order, and keeps the next reads going while
+// the network drains what we have
+void read_file(Uring &ring, bool fixed, vector<char> &pool, uint32_t id, Flow &flow)
 {
-    uint16_t ack = p.ack_num();
-    uint16_t max = (base_num + MSN/2) % MSN;
+    Response &response = flow.response;
+    if (response.fd == -1 || flow.conn.closed())
+        return;
 
-    if (base_num < max) // no overflow of window
+    char *base = &pool[(size_t) id * URING_READS * READ_CHUNK];
+    while (response.reads[response.next_feed].len != 0 && flow.conn.writable() != 0)
     {
-        if (ack >= base_num && ack <= max)
+        Read_buffer &b = response.reads[response.next_feed];
+        b.pos += flow.conn.write(base + response.next_feed * READ_CHUNK + b.pos, b.len - b.pos);
+        if (b.pos == b.len)
         {
-            return true;
+            b.len = b.pos = 0;
+            response.next_feed = (response.next_feed + 1) % URING_READS;
         }
-        else
+    }
+
+    bool in_flight = false;
+    for (const Read_buffer &b : response.reads)
+    {
+        in_flight = in_flight || b.reading;
+    }
+    if (!response.read_eof)
+    {
+        while (!response.reads[response.next_read].reading && response.reads[response.next_read].len == 0)
         {
-            return false;
+            uint16_t i = response.next_read;
+            response.reads[i].reading = true;
+            char *buf = base + i * READ_CHUNK;
+            if (fixed)
+                ring.read_fixed(response.fd, buf, READ_CHUNK, response.read_offset, id * URING_READS + i, tag(OP_READ, id, i));
+            else
+                ring.read(response.fd, buf, READ_CHUNK, response.read_offset, tag(OP_READ, id, i));
+            response.read_offset += READ_CHUNK;
+            response.next_read = (i + 1) % URING_READS;
         }
     }
-    else // window overflowed
+    else if (!in_flight && response.reads[response.next_feed].len == 0)
+    {
+        close(response.fd);
+        response.fd = -1;
+        response.read_offset = 0;
+        response.read_eof = false;
+        response.next_read = response.next_feed = 0;
+        flow.conn.end_response();
+    }
+}
+
+// the same loop as serve_epoll, but datagrams and file reads are queued on
+// the rings and one io_uring_enter per pass submits them all and waits
+void serve_uring(Uring &ring, Server &server)
+{
+    int sockfd = server.sockfd;
+    vector<Uring_slot> recvs(URING_RECVS), sends(URING_SENDS);
+    vector<uint16_t> free_sends;
+    for (uint16_t i = 0; i < URING_SENDS; i++)
+    {
+        free_sends.push_back(i);
+    }
+    for (uint16_t i = 0; i < URING_RECVS; i++)
+    {
+        post_recv(ring, sockfd, recvs[i], i);
+    }
+
+    // file buffers are registered once so each read skips pinning them,
+    // every connection slot owns URING_READS of them
+    vector<char> pool((size_t) MAX_FLOWS * URING_READS * READ_CHUNK);
+    vector<struct iovec> read_iovs(MAX_FLOWS * URING_READS);
+    for (size_t i = 0; i < read_iovs.size(); i++)
+    {
+        read_iovs[i].iov_base = &pool[i * READ_CHUNK];
+        read_iovs[i].iov_len = READ_CHUNK;
+    }
+    bool fixed = ring.register_buffers(&read_iovs[0], read_iovs.size());
+
+    vector<char> chunk(READ_CHUNK);
+    while (!done(server))
     {
-        if (ack > max && ack < base_num)
+        service(server, true, chunk);
+        uint64_t now = now_us();
+        for (uint32_t id = 0; id < MAX_FLOWS; id++)
         {
-            return false;
+            if (server.flows[id])
+                read_file(ring, fixed, pool, id, *server.flows[id]);
         }
-        else
+
+        // queue everything the connections have ready
+        uint64_t wake = 0;
+        if (!free_sends.empty())
         {
-            return true;
+            wake = schedule(server, now, [&](uint32_t id, Flow &flow, const Transmit &t)
+            {
+                uint16_t i = free_sends.back();
+                free_sends.pop_back();
+                Uring_slot &slot = sends[i];
+                slot.t = t;
+                slot.addr = t.challenge ? flow.challenge_addr : flow.addr;
+                memset(&slot.msg, 0, sizeof(slot.msg));
+                slot.iov.iov_base = &slot.t.pkt;
+                slot.iov.iov_len = slot.t.len;
+                slot.msg.msg_name = &slot.addr;
+                slot.msg.msg_namelen = t.challenge ? flow.challenge_addr_len : flow.addr_len;
+                slot.msg.msg_iov = &slot.iov;
+                slot.msg.msg_iovlen = 1;
+                ring.sendmsg(sockfd, &slot.msg, tag(OP_SEND, id, i));
+                flow.sends++;
+                return !free_sends.empty();
+            });
+        }
+
+        // a connection's slot is only reused once its reads and sends are
+        // back, so no late completion lands on the next connection in it
+        for (uint32_t id = 0; id < MAX_FLOWS; id++)
+        {
+            if (!server.flows[id] || !server.flows[id]->conn.closed())
+                continue;
+            bool reading = false;
+            for (const Read_buffer &b : server.flows[id]->response.reads)
+            {
+                reading = reading || b.reading;
+            }
+            if (!reading && server.flows[id]->sends == 0)
+                reap(server, id);
+        }
+        if (done(server))
+            break;
+
+        // submit, then wait for the next datagram, completion, timer or rate limit
+        uint64_t deadline = wake;
+        for (const unique_ptr<Flow> &flow : server.flows)
+        {
+            if (flow && flow->conn.next_timeout() != 0 && (deadline == 0 || flow->conn.next_timeout() < deadline))
+                deadline = flow->conn.next_timeout();
+        }
+        int64_t wait_us = -1;
+        if (deadline != 0)
+        {
+            now = now_us();
+            wait_us = deadline > now ? deadline - now : 0;
+        }
+        int status = ring.submit_and_wait(wait_us);
+        process_error(status, "io_uring_enter");
+
+        struct io_uring_cqe cqe;
+        while (ring.next_cqe(cqe))
+        {
+            uint32_t id = (cqe.user_data >> 16) & 0xffffffff;
+            uint16_t i = cqe.user_data & 0xffff;
+            Flow *flow = id < MAX_FLOWS ? server.flows[id].get() : NULL;
+            switch (cqe.user_data >> 48)
+            {
+            case OP_RECV:
+                if (cqe.res < 0)
+                {
+                    errno = -cqe.res;
+                    process_error(-1, "recv ACK");
+                }
+                flow = flow_for(server, (const char *) &recvs[i].t.pkt, cqe.res, recvs[i].addr, recvs[i].msg.msg_namelen);
+                if (flow != NULL)
+                    flow->conn.on_datagram((const char *) &recvs[i].t.pkt, cqe.res, now_us());
+                post_recv(ring, sockfd, recvs[i], i);
+                break;
+
+            case OP_SEND:
+                free_sends.push_back(i);
+                if (flow != NULL)
+                    flow->sends--;
+                if (cqe.res < 0)
+                {
+                    errno = -cqe.res;
+                    if (errno != EMSGSIZE && errno != EAGAIN)
+                        process_error(-1, "sending packet");
+                    if (flow != NULL)
+                        flow->conn.on_send_error(sends[i].t, errno); // dropped, the timers will resend it
+                }
+                break;
+
+            case OP_READ:
+                if (flow == NULL)
+                    break;
+                flow->response.reads[i].reading = false;
+                if (cqe.res < 0)
+                {
+                    errno = -cqe.res;
+                    perror("reading requested file");
+                }
+                flow->response.reads[i].len = cqe.res > 0 ? cqe.res : 0;
+                if (cqe.res < (int) READ_CHUNK)
+                    flow->response.read_eof = true;
+                break;
+            }
         }
     }
 }
+#endif
 
-uint16_t update_window(const Packet &p, unordered_map<uint16_t, Packet_info> &window, uint16_t &base_num, RTO &rto)
+void send_transmit(int sockfd, const Transmit &t, Server_connection &conn, Gso_batch *batch, const struct sockaddr_storage &addr, socklen_t addr_len)
 {
-    uint16_t n_removed = 0;
-
-    while (base_num > p.ack_num())
+    int status;
+    if (batch != NULL && !t.probe)
     {
-        auto found = window.find(base_num);
-        if (found == window.end())
+        if (!batch->fits(t.len))
         {
-            cerr << "could not find base_num packet with base_num " << base_num << " and ack num " << p.ack_num() << " in window, update_window" << endl;
-            exit(1);
+            status = batch->flush(sockfd, (const struct sockaddr *) &addr, addr_len);
+            process_error(status, "sending segmented packets");
         }
-        rto.update_RTO(found->second.get_time_sent());
-        uint16_t len = found->second.data_len();
-        window.erase(base_num);
-        n_removed += len;
-        base_num = (base_num + len) % MSN;
+        batch->append((const char *) &t.pkt, t.len);
+        return;
     }
-    while (base_num < p.ack_num())
+
+    // probes go out on their own so an oversized one fails by itself
+    if (batch != NULL)
     {
-        auto found = window.find(base_num);
-        if (found == window.end())
-        {
-            cerr << "could not find base_num packet with base_num " << base_num << " and ack num " << p.ack_num() << " in window, update_window" << endl;
-            exit(1);
-        }
-        rto.update_RTO(found->second.get_time_sent());
-        uint16_t len = found->second.data_len();
-        window.erase(base_num);
-        n_removed += len;
-        base_num = (base_num + len) % MSN;
+        status = batch->flush(sockfd, (const struct sockaddr *) &addr, addr_len);
+        process_error(status, "sending segmented packets");
+    }
+    status = sendto(sockfd, (const void *) &t.pkt, t.len, 0, (const struct sockaddr *) &addr, addr_len);
+    if (status == -1 && (errno == EMSGSIZE || errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        conn.on_send_error(t, errno); // dropped, the timers will resend it
+        return;
+    }
+    process_error(status, t.probe ? "sending probe" : "sending packet");
+}
+
+// file a request names, or "" if it may not be served
+string request_path(const string &root, const string &name)
+{
+    struct stat root_stat;
+    if (stat(root.c_str(), &root_stat) == -1)
+    {
+        return "";
+    }
+
+    // a single file is served whatever the client asks for
+    if (!S_ISDIR(root_stat.st_mode))
+    {
+        return root;
+    }
+
+    // otherwise only names inside the directory, no absolute paths or ..
+    if (!safe_path(name))
+    {
+        return "";
     }
+    return root + "/" + name;
+}
+
+bool open_file(const string &root, const string &name, ifstream &file)
+{
+    string path = request_path(root, name);
+    if (path.empty())
+    {
+        return false;
+    }
+
+    file.open(path);
+    return file.is_open();
+}
+
+istream *open_request(const string &root, const string &name, ifstream &file, istringstream &generated, Chunk_index &index, Chunk_cache &cache)
+{
+    file.close();
+    file.clear();
 
-    return n_removed;
+    // "/manifest DIR" lists DIR's files and their chunks for a sync
+    size_t prefix_len = strlen(SYNC_MANIFEST);
+    if (name.compare(0, prefix_len, SYNC_MANIFEST) == 0)
+    {
+        string dir = name.substr(min(prefix_len + 1, name.size()));
+        if (dir == ".")
+            dir.clear();
+        if (!dir.empty() && !safe_path(dir))
+            return NULL;
+
+        generated.clear();
+        generated.str(build_manifest(dir.empty() ? root : root + "/" + dir, index, cache));
+        return &generated;
+    }
+
+    // "/chunks HASH..." sends chunks from that manifest the client lacks
+    prefix_len = strlen(SYNC_CHUNKS);
+    if (name.compare(0, prefix_len, SYNC_CHUNKS) == 0)
+    {
+        generated.clear();
+        generated.str(build_chunks(name, index));
+        return &generated;
+    }
+
+    if (!open_file(root, name, file))
+    {
+        return NULL;
+    }
+    return &file;
 }
 
 int set_up_socket(char* port)
@@ -0,0 +1,1179 @@
+#include "server_connection.h"
+#include <cstring> // for memcpy
+#include <cmath> // for floor
+#include <algorithm> // for min, max
+#include <errno.h> // for EMSGSIZE
+#include <arpa/inet.h> // for htons, ntohs
+
+using namespace std;
+
+Server_connection::Server_connection(uint16_t isn, uint64_t cookie, bool probing, uint32_t conn_id)
+    : m_pmtu(DEFAULT_MSS)
+{
+    m_state = LISTEN;
+    m_log = NULL;
+    m_conn_id = conn_id;
+    m_cookie = cookie;
+    m_probing = probing;
+
+    m_mss = DEFAULT_MSS;
+    m_seq_num = isn % MSN;
+    m_ack_num = 0;
+    m_base_num = m_seq_num;
+    m_prev_ack = m_seq_num;
+    m_handshake_seq = 0;
+    m_more = false;
+    m_response_ended = false;
+    m_push_len = 0;
+    m_send_pos = 0;
+    m_send_syn_ack = false;
+    m_send_control = false;
+    m_time_wait_end = 0;
+    m_validating = false;
+    m_path_token = 0;
+    m_send_challenge = false;
+    m_challenges = 0;
+    m_new_host = false;
+
+    m_cwnd = min((double) m_mss, MSN / 2.0);
+    m_ssthresh = INITIAL_SSTHRESH;
+    m_cwd_pkts = 0;
+    m_pkts_sent = 0;
+    m_dup_ack = 0;
+    m_recv_window = UINT16_MAX;
+    m_slow_start = true;
+    m_backoffs = 0;
+
+    m_in_recovery = false;
+    m_recovery_end = 0;
+    m_recover_fs = 0;
+    m_prr_delivered = 0;
+    m_prr_out = 0;
+
+    m_rack_xmit = 0;
+    m_rack_end = 0;
+    m_rack_rtt = 0;
+    m_min_rtt = 0;
+    m_reordering = false;
+    m_reo_mult = 1;
+    m_reo_raised = 0;
+    m_recoveries = 0;
+    m_reorder_deadline = 0;
+
+    m_round_end = m_seq_num;
+    m_round_min = 0;
+    m_last_round_min = 0;
+    m_round_samples = 0;
+    m_round_need = HYSTART_FEW_SAMPLES;
+    m_retransmits = 0;
+    m_timeouts = 0;
+    m_delay_exits = 0;
+
+    m_seeded = false;
+    m_delivered = 0;
+    m_busy_us = 0;
+    m_busy_start = 0;
+}
+
+void Server_connection::set_log(ostream *log)
+{
+    m_log = log;
+}
+
+void Server_connection::seed_path(const Path_metrics &metrics)
+{
+    m_seed = metrics;
+    m_seeded = true;
+    if (m_state != LISTEN)
+        apply_seed();
+}
+
+bool Server_connection::path_metrics(Path_metrics &metrics, uint64_t now) const
+{
+    if (!m_rto.sampled())
+        return false;
+    uint64_t busy = m_busy_us + (m_window.size() != 0 ? now - m_busy_start : 0);
+    metrics.srtt = m_rto.get_EstimatedRTT();
+    metrics.rttvar = m_rto.get_DevRTT();
+    // like tcp_metrics: a connection that never left slow start has an
+    // ssthresh that says nothing, half of where cwnd got to does
+    metrics.ssthresh = m_ssthresh < INITIAL_SSTHRESH ? max(m_ssthresh, (uint16_t) (m_cwnd / 2)) : (uint16_t) (m_cwnd / 2);
+    metrics.bandwidth = busy != 0 ? m_delivered * 1000000 / busy : 0;
+    metrics.delivered = m_delivered;
+    return true;
+}
+
+void Server_connection::on_datagram(const char *buf, size_t len, uint64_t now)
+{
+    if (len < HEADER_LEN || m_state == CLOSED)
+        return;
+
+    Packet p;
+    len = min(len, sizeof(p));
+    memcpy((void *) &p, buf, len);
+    size_t data_len = len - HEADER_LEN;
+    if (!p.syn_set() && p.conn_id() != m_conn_id)
+        return;
+
+    if (p.probe_set()) // probe ack echoes the size that got through
+    {
+        on_probe_ack(p, data_len);
+        return;
+    }
+    if (p.path_set()) // the client echoing a challenge
+    {
+        on_path_response(buf + HEADER_LEN, data_len, now);
+        return;
+    }
+
+    switch (m_state)
+    {
+    case LISTEN:
+        if (p.syn_set())
+            accept(p, data_len);
+        break;
+
+    case SYN_RCVD: // recv ACK after SYN ACK
+        if (p.syn_set())
+        {
+            m_send_syn_ack = true;
+        }
+        else if (p.seq_num() == m_handshake_seq)
+        {
+            if (m_log != NULL)
+                *m_log << "Receiving packet " << p.ack_num() << endl;
+            m_prev_ack = p.ack_num();
+            m_ack_num = (p.seq_num() + 1) % MSN;
+            m_backoffs = 0;
+            m_state = ESTABLISHED;
+        }
+        break;
+
+    case ESTABLISHED:
+        if (p.syn_set()) // SYN ACK was lost, client is still waiting for it
+        {
+            m_send_syn_ack = true;
+        }
+        else if (p.seq_num() != m_handshake_seq && m_window.size() != 0 && valid_ack(p))
+        {
+            on_ack(p, data_len, now);
+        }
+        else if (p.ack_set() && p.ack_num() == m_base_num) // nothing in flight, a window update
+        {
+            m_recv_window = p.recv_window();
+        }
+        break;
+
+    case EOF_SENT: // the ACK for the end of file carries the next request
+        if (!p.ack_set() || p.ack_num() != m_seq_num)
+            break;
+        if (m_log != NULL)
+            *m_log << "Receiving packet " << p.ack_num() << endl;
+        m_prev_ack = p.ack_num();
+        m_ack_num = (p.seq_num() + 1) % MSN;
+        m_more = p.more_set();
+        m_response_ended = false;
+        m_push_len = 0;
+        m_dup_ack = 0;
+        m_backoffs = 0;
+        m_in_recovery = false;
+        m_reorder_deadline = 0;
+        m_state = ESTABLISHED;
+        m_events.push_back({EVENT_REQUEST, string(buf + HEADER_LEN, data_len), m_more});
+        break;
+
+    case FIN_SENT: // recv FIN ACK
+        if (!p.fin_set() || !p.ack_set())
+            break;
+        if (m_log != NULL)
+            *m_log << "Receiving packet " << p.ack_num() << endl;
+        m_ack_num = (p.seq_num() + 1) % MSN;
+
+        // send ACK after FIN ACK, then linger in case it is lost
+        send_control(Packet(0, 1, 0, m_seq_num, m_ack_num, 0, "", 0), 0);
+        if (m_log != NULL)
+            *m_log << "Sending packet " << m_seq_num << endl;
+        m_time_wait_end = now + 2 * m_rto.get_timeout();
+        m_state = TIME_WAIT;
+        break;
+
+    case TIME_WAIT: // if client send FIN ACK again, send ACK
+        if (p.fin_set() && p.ack_set())
+            m_send_control = true;
+        break;
+
+    default:
+        break;
+    }
+}
+
+bool Server_connection::poll_transmit(Transmit &t, uint64_t now)
+{
+    t.probe = false;
+    t.challenge = false;
+    if (m_send_syn_ack)
+    {
+        m_send_syn_ack = false;
+        m_syn_ack.update_time(now, m_rto.get_timeout());
+        t.pkt = m_syn_ack.pkt();
+        t.len = HEADER_LEN + m_syn_ack.data_len();
+        return true;
+    }
+    if (m_send_control)
+    {
+        m_send_control = false;
+        m_control.update_time(now, m_rto.get_timeout());
+        t.pkt = m_control.pkt();
+        t.len = HEADER_LEN + m_control.data_len();
+        return true;
+    }
+    if (m_send_challenge)
+    {
+        m_send_challenge = false;
+        m_challenges++;
+        m_challenge.update_time(now, m_rto.get_timeout() << (m_challenges - 1));
+        t.pkt = m_challenge.pkt();
+        t.len = HEADER_LEN + m_challenge.data_len();
+        t.challenge = true;
+        if (m_log != NULL)
+            *m_log << "Sending path challenge" << (m_challenges > 1 ? " Retransmission" : "") << endl;
+        return true;
+    }
+    if (m_state != ESTABLISHED)
+        return false;
+
+    // resend the first segment counted as lost, as the window allows
+    uint32_t in_flight = pipe();
+    for (uint16_t seq = m_base_num; seq != m_seq_num; )
+    {
+        auto found = m_window.find(seq);
+        if (found == m_window.end())
+            break;
+        Packet_info &segment = found->second;
+        seq = (seq + segment.data_len()) % MSN;
+        if (!segment.lost())
+            continue;
+        if (floor(m_cwnd) < in_flight + segment.data_len())
+            break;
+
+        m_retransmits++;
+        segment.set_lost(false);
+        segment.set_retransmitted();
+        segment.update_time(now, m_rto.get_timeout());
+        if (m_in_recovery)
+            m_prr_out += segment.data_len();
+        t.pkt = segment.pkt();
+        t.len = HEADER_LEN + segment.data_len();
+        if (m_log != NULL)
+            *m_log << "Sending packet " << t.pkt.seq_num() << " " << m_cwnd << " " << m_ssthresh << " Retransmission" << endl;
+        return true;
+    }
+
+    // transmit a new segment, as allowed, holding back a short one until
+    // the application flushes or has nothing more to add to it, and one
+    // the client has no room for past what it has acked until its window
+    // opens; delivered segments leave the pipe but still hold sequence
+    // space until acked
+    size_t pending = m_send_buf.size() - m_send_pos;
+    size_t room = m_recv_window > flight_size() ? m_recv_window - flight_size() : 0;
+    size_t len = min(pending, min((size_t) m_mss, room));
+    if (floor(m_cwnd) >= in_flight + m_mss && flight_size() + len <= MSN/2 && len != 0 && (len == m_mss || m_push_len != 0 || (len == pending && m_response_ended)))
+    {
+        Packet p(0, 0, 0, m_seq_num, m_ack_num, 0, &m_send_buf[m_send_pos], len);
+        p.set_conn_id(m_conn_id);
+        if (m_window.size() == 0)
+            m_busy_start = now;
+        m_window.emplace(m_seq_num, Packet_info(p, len, now, m_rto.get_timeout()));
+        if (m_log != NULL)
+            *m_log << "Sending packet " << m_seq_num << " " << m_cwnd << " " << m_ssthresh << endl;
+        m_seq_num = (m_seq_num + len) % MSN;
+        if (m_in_recovery)
+            m_prr_out += len;
+        m_send_pos += len;
+        m_push_len -= min(m_push_len, len);
+        if (m_send_pos == m_send_buf.size())
+        {
+            m_send_buf.clear();
+            m_send_pos = 0;
+        }
+
+        t.pkt = p;
+        t.len = HEADER_LEN + len;
+        return true;
+    }
+
+    // probe a larger segment size alongside the data, the probe is
+    // padding at seq_num and does not take up sequence space
+    uint16_t probe_size = m_window.size() != 0 ? m_pmtu.probe_due(now) : 0;
+    if (probe_size != 0)
+    {
+        static const char padding[MAX_MSS] = {0};
+        t.pkt = Packet(0, 0, 0, m_seq_num, m_ack_num, 0, padding, probe_size);
+        t.pkt.set_probe(true);
+        t.pkt.set_conn_id(m_conn_id);
+        t.len = HEADER_LEN + probe_size;
+        t.probe = true;
+        m_pmtu.probe_sent(probe_size, now);
+        return true;
+    }
+
+    // nothing in flight and nothing left to send
+    if (m_response_ended && pending == 0 && m_window.size() == 0)
+    {
+        finish_response();
+        return poll_transmit(t, now);
+    }
+    return false;
+}
+
+void Server_connection::on_send_error(const Transmit &t, int err)
+{
+    // the local interface refused the size outright
+    if (t.probe && err == EMSGSIZE)
+        m_pmtu.probe_too_big(t.len - HEADER_LEN);
+}
+
+bool Server_connection::on_path_change(const char *buf, size_t len, uint64_t token, bool same_host, uint64_t now)
+{
+    if (len < HEADER_LEN || m_state == LISTEN || m_state == CLOSED)
+        return false;
+    Packet p;
+    memcpy((void *) &p, buf, HEADER_LEN);
+    if (p.conn_id() != m_conn_id || (p.ack_set() && newer(m_prev_ack, p.ack_num())))
+        return false;
+
+    // only whoever gets the challenge can echo its token, so nobody can
+    // point the transfer at an address that did not ask for it
+    char data[PATH_TOKEN_LEN];
+    memcpy(data, &token, PATH_TOKEN_LEN);
+    Packet challenge(0, 0, 0, m_seq_num, m_ack_num, 0, data, PATH_TOKEN_LEN);
+    challenge.set_path(true);
+    challenge.set_conn_id(m_conn_id);
+    m_challenge = Packet_info(challenge, PATH_TOKEN_LEN, now, 0);
+    m_path_token = token;
+    m_validating = true;
+    m_send_challenge = true;
+    m_challenges = 0;
+    m_new_host = !same_host;
+    if (m_log != NULL)
+        *m_log << "Path change" << (same_host ? "" : " to a new host") << ", validating" << endl;
+    return true;
+}
+
+uint64_t Server_connection::next_timeout() const
+{
+    uint64_t deadline = state_timeout();
+    if (m_validating && !m_send_challenge && (deadline == 0 || m_challenge.get_max_time() < deadline))
+        return m_challenge.get_max_time();
+    return deadline;
+}
+
+// the timer of the state the connection is in, path validation aside
+uint64_t Server_connection::state_timeout() const
+{
+    switch (m_state)
+    {
+    case SYN_RCVD:
+        return m_syn_ack.get_max_time();
+    case ESTABLISHED:
+    {
+        uint64_t rto = rto_deadline();
+        if (m_reorder_deadline != 0 && (rto == 0 || m_reorder_deadline < rto))
+            return m_reorder_deadline;
+        return rto;
+    }
+    case EOF_SENT:
+    case FIN_SENT:
+        return m_control.get_max_time();
+    case TIME_WAIT:
+        return m_time_wait_end;
+    default:
+        return 0;
+    }
+}
+
+void Server_connection::on_timeout(uint64_t now)
+{
+    if (m_validating && !m_send_challenge && now >= m_challenge.get_max_time())
+        on_challenge_timeout();
+
+    uint64_t deadline = state_timeout();
+    if (deadline == 0 || now < deadline)
+        return;
+
+    switch (m_state)
+    {
+    case SYN_RCVD: // backed off like any other timeout, a spoofed SYN must not hold its slot for long
+        if (give_up(MAX_SYN_ACKS))
+            break;
+        m_send_syn_ack = true;
+        break;
+
+    case ESTABLISHED:
+    {
+        // a segment in doubt has waited out the reordering window
+        uint64_t rto = rto_deadline();
+        if (rto == 0 || now < rto)
+        {
+            if (detect_loss(now) && !m_in_recovery)
+            {
+                enter_recovery();
+                update_prr(0);
+            }
+            break;
+        }
+
+        // retransmission timeout: everything not known delivered is lost,
+        // and only a repeated timeout backs the timer off and halves again
+        if (m_backoffs == 0)
+        {
+            m_ssthresh = max(flight_size() / 2, 2 * m_mss);
+            m_backoffs++;
+        }
+        else if (give_up(MAX_BACKOFFS))
+        {
+            break;
+        }
+        for (auto &i : m_window)
+        {
+            if (!i.second.delivered())
+                i.second.set_lost(true);
+        }
+        m_cwnd = m_mss;
+        m_dup_ack = 0;
+        m_slow_start = true;
+        m_in_recovery = false;
+        m_reorder_deadline = 0;
+        m_ssthresh = max(m_ssthresh, m_mss); // make sure ssthresh is at least mss
+        m_timeouts++;
+
+        // segments of the probed size keep vanishing: the path MTU has
+        // dropped under it, so start over from DEFAULT_MSS
+        if (m_backoffs >= BLACK_HOLE_TIMEOUTS && m_mss > DEFAULT_MSS)
+        {
+            restart_pmtu();
+            if (m_log != NULL)
+                *m_log << "Path MTU black hole, segment size " << m_mss << endl;
+        }
+        break;
+    }
+
+    case EOF_SENT:
+    case FIN_SENT:
+        if (give_up(MAX_BACKOFFS))
+            break;
+        m_send_control = true;
+        break;
+
+    case TIME_WAIT: // client has its ACK, everything is fine close
+        m_state = CLOSED;
+        m_events.push_back({EVENT_CLOSED, "", false});
+        break;
+
+    default:
+        break;
+    }
+}
+
+bool Server_connection::poll_event(Event &e)
+{
+    if (m_events.empty())
+        return false;
+    e = m_events.front();
+    m_events.pop_front();
+    return true;
+}
+
+size_t Server_connection::writable() const
+{
+    if (m_response_ended || m_state == CLOSED || m_state == LISTEN)
+        return 0;
+    size_t buffered = m_send_buf.size() - m_send_pos;
+    return buffered >= SEND_BUFFER ? 0 : SEND_BUFFER - buffered;
+}
+
+size_t Server_connection::write(const char *data, size_t len)
+{
+    len = min(len, writable());
+    if (m_send_pos != 0) // drop what is already in segments before growing
+    {
+        m_send_buf.erase(0, m_send_pos);
+        m_send_pos = 0;
+    }
+    m_send_buf.append(data, len);
+    return len;
+}
+
+void Server_connection::flush()
+{
+    if (m_state == SYN_RCVD || m_state == ESTABLISHED)
+        m_push_len = m_send_buf.size() - m_send_pos;
+}
+
+void Server_connection::end_response()
+{
+    if (m_state == SYN_RCVD || m_state == ESTABLISHED)
+        m_response_ended = true;
+}
+
+bool Server_connection::closed() const
+{
+    return m_state == CLOSED;
+}
+
+double Server_connection::cwnd() const
+{
+    return m_cwnd;
+}
+
+uint16_t Server_connection::ssthresh() const
+{
+    return m_ssthresh;
+}
+
+uint16_t Server_connection::mss() const
+{
+    return m_mss;
+}
+
+uint32_t Server_connection::retransmits() const
+{
+    return m_retransmits;
+}
+
+uint32_t Server_connection::timeouts() const
+{
+    return m_timeouts;
+}
+
+uint32_t Server_connection::delay_exits() const
+{
+    return m_delay_exits;
+}
+
+void Server_connection::accept(const Packet &p, size_t data_len)
+{
+    if (m_log != NULL)
+        *m_log << "Receiving packet " << p.ack_num() << endl;
+    m_ack_num = (p.seq_num() + 1) % MSN;
+    m_more = p.more_set();
+    m_handshake_seq = m_ack_num;
+
+    // SYN data is [max segment size][cookie][requested file name], clients
+    // that send less get the old fixed size, no fast open, and the default file
+    char syn_data[MAX_MSS];
+    p.data(syn_data, data_len);
+
+    uint16_t max_mss = DEFAULT_MSS;
+    if (data_len >= sizeof(uint16_t))
+    {
+        uint16_t peer_mss;
+        memcpy(&peer_mss, syn_data, sizeof(peer_mss));
+        max_mss = max(min(ntohs(peer_mss), MAX_MSS), DEFAULT_MSS);
+    }
+    max_mss = min(max_mss, (uint16_t) (MSN / 2 / MIN_WINDOW_SEGMENTS));
+    m_pmtu = Pmtu(m_probing ? max_mss : DEFAULT_MSS);
+    m_mss = m_pmtu.mss();
+    m_cwnd = min((double) m_mss, MSN / 2.0);
+    if (m_seeded)
+        apply_seed();
+
+    // a valid cookie proves the client owns its address, so data may go
+    // out before the handshake completes without risk of amplification
+    bool fast_open = false;
+    if (data_len >= SYN_OPTIONS_LEN)
+    {
+        uint64_t peer_cookie;
+        memcpy(&peer_cookie, syn_data + sizeof(uint16_t), COOKIE_LEN);
+        fast_open = peer_cookie == m_cookie;
+    }
+
+    string name;
+    if (data_len > SYN_OPTIONS_LEN)
+    {
+        name.assign(syn_data + SYN_OPTIONS_LEN, data_len - SYN_OPTIONS_LEN);
+    }
+
+    // SYN ACK with the negotiated maximum and a fresh cookie
+    char syn_ack_data[SYN_OPTIONS_LEN];
+    uint16_t syn_mss = htons(max_mss);
+    memcpy(syn_ack_data, &syn_mss, sizeof(syn_mss));
+    memcpy(syn_ack_data + sizeof(syn_mss), &m_cookie, COOKIE_LEN);
+    Packet syn_ack(1, 1, 0, m_seq_num, m_ack_num, 0, syn_ack_data, SYN_OPTIONS_LEN);
+    syn_ack.set_conn_id(m_conn_id); // the client uses it from its ACK on
+    m_syn_ack = Packet_info(syn_ack, SYN_OPTIONS_LEN, 0, 0);
+    m_send_syn_ack = true;
+    if (m_log != NULL)
+        *m_log << "Sending packet " << m_seq_num << " " << m_mss << " " << m_ssthresh << " SYN" << (fast_open ? " Fast open" : "") << endl;
+    m_seq_num = (m_seq_num + 1) % MSN;
+    m_base_num = m_seq_num;
+    m_prev_ack = m_base_num;
+
+    // with fast open, start sending right away and pick up the ACK later
+    if (fast_open)
+    {
+        m_ack_num = (m_handshake_seq + 1) % MSN;
+        m_state = ESTABLISHED;
+    }
+    else
+    {
+        m_state = SYN_RCVD;
+    }
+    m_events.push_back({EVENT_REQUEST, name, m_more});
+}
+
+void Server_connection::on_ack(const Packet &p, size_t data_len, uint64_t now)
+{
+    if (m_log != NULL)
+        *m_log << "Receiving packet " << p.ack_num() << endl;
+
+    // newly delivered bytes: everything the cumulative ACK moves past that
+    // was not already known delivered, and the segment the ACK is for
+    uint32_t delivered = 0;
+    if (m_prev_ack != p.ack_num()) // new ack
+    {
+        uint16_t n_removed;
+        if (!update_window(p, now, n_removed, delivered))
+            return;
+        m_prev_ack = p.ack_num();
+        m_ack_num = (p.seq_num() + 1) % MSN;
+        m_dup_ack = 0;
+        m_backoffs = 0;
+
+        if (m_in_recovery)
+        {
+            // recovery ends once everything sent before it is acked
+            uint16_t left = (m_recovery_end + MSN - m_base_num) % MSN;
+            if (left == 0 || left > MSN/2)
+            {
+                m_in_recovery = false;
+                m_cwnd = m_ssthresh;
+                m_cwd_pkts = m_cwnd / m_mss;
+                m_pkts_sent = 0;
+            }
+        }
+        else if (m_slow_start)
+        {
+            m_cwnd += m_mss;
+            if (m_cwnd >= m_ssthresh)
+            {
+                m_slow_start = false;
+                m_cwd_pkts = m_cwnd / m_mss;
+                m_pkts_sent = 0;
+            }
+        }
+        else // congestion avoidance
+        {
+            if (m_pkts_sent == m_cwd_pkts)
+            {
+                m_cwd_pkts = m_cwnd / m_mss;
+                m_pkts_sent = 0;
+            }
+            m_cwnd += m_mss / (double) m_cwd_pkts;
+            m_pkts_sent++;
+        }
+    }
+    else if (p.recv_window() == m_recv_window) // duplicate, not just the window opening
+    {
+        m_dup_ack++;
+    }
+
+    // clients echo the segment each ACK is for, older ones only count
+    // duplicates
+    if (data_len >= sizeof(uint16_t))
+    {
+        uint16_t echo;
+        p.data((char *) &echo, sizeof(echo));
+        echo = ntohs(echo);
+        auto found = m_window.find(echo);
+        if (found != m_window.end() && !found->second.delivered())
+        {
+            found->second.set_delivered();
+            found->second.set_lost(false);
+            delivered += found->second.data_len();
+            on_delivered(found->second, echo, now);
+        }
+    }
+    else if (m_dup_ack == DUP_THRESH)
+    {
+        auto found = m_window.find(m_base_num);
+        if (found != m_window.end() && !found->second.lost())
+        {
+            found->second.set_lost(true);
+            if (!m_in_recovery)
+                enter_recovery();
+        }
+    }
+
+    if (detect_loss(now) && !m_in_recovery)
+        enter_recovery();
+    if (m_in_recovery)
+        update_prr(delivered);
+
+    m_cwnd = min(m_cwnd, MSN / 2.0); // make sure cwnd is not greater than MSN/2
+    m_cwnd = max(m_cwnd, (double) m_mss); // make sure cwnd is not less than mss
+    m_ssthresh = max(m_ssthresh, m_mss); // make sure ssthresh is at least mss
+
+    m_recv_window = p.recv_window();
+}
+
+// RACK bookkeeping for a segment the receiver has: remember the latest
+// sent one, and widen the reordering window if an older one turned up late
+void Server_connection::on_delivered(const Packet_info &segment, uint16_t seq_num, uint64_t now)
+{
+    uint64_t rtt = now - segment.get_time_sent();
+
+    // an ACK for a retransmission faster than the path allows was for the
+    // original, which was only late: count it as reordering, not as a sample
+    bool spurious = segment.retransmitted() && rtt < m_min_rtt;
+    if (!segment.retransmitted() && (m_min_rtt == 0 || rtt < m_min_rtt))
+        m_min_rtt = max(rtt, (uint64_t) 1);
+
+    uint16_t end = (seq_num + segment.data_len()) % MSN;
+    bool latest = segment.get_time_sent() > m_rack_xmit || (segment.get_time_sent() == m_rack_xmit && newer(end, m_rack_end));
+    if (latest && !spurious)
+    {
+        m_rack_xmit = segment.get_time_sent();
+        m_rack_end = end;
+        m_rack_rtt = rtt;
+    }
+    else if ((spurious || !segment.retransmitted()) && now - m_reo_raised > m_rto.get_EstimatedRTT())
+    {
+        // delivered after a segment sent later: the path reorders
+        m_reordering = true;
+        m_reo_mult = min(m_reo_mult + 1, RACK_MAX_REO_MULT);
+        m_reo_raised = now;
+        m_recoveries = 0;
+    }
+}
+
+// marks every segment sent a reordering window before the latest one
+// delivered as lost, and sets a timer for the ones not there yet; true
+// if any segment was newly marked
+bool Server_connection::detect_loss(uint64_t now)
+{
+    m_reorder_deadline = 0;
+    if (m_rack_xmit == 0)
+        return false;
+
+    // until the path has been seen to reorder, DUP_THRESH segments past a
+    // hole or being in recovery already is proof enough
+    uint16_t n_delivered = 0;
+    for (const auto &i : m_window)
+    {
+        n_delivered += i.second.delivered();
+    }
+    uint64_t reo_wnd = min(m_reo_mult * m_min_rtt / 4, m_rto.get_EstimatedRTT());
+    if (!m_reordering && (m_in_recovery || n_delivered >= DUP_THRESH))
+        reo_wnd = 0;
+    bool marked = false;
+    for (uint16_t seq = m_base_num; seq != m_seq_num; )
+    {
+        auto found = m_window.find(seq);
+        if (found == m_window.end())
+            break;
+        Packet_info &segment = found->second;
+        uint16_t end = (seq + segment.data_len()) % MSN;
+        seq = end;
+        if (segment.delivered() || segment.lost())
+            continue;
+        uint64_t sent = segment.get_time_sent();
+        if (sent > m_rack_xmit || (sent == m_rack_xmit && !newer(m_rack_end, end)))
+            continue; // sent after the latest delivered segment, nothing known yet
+
+        uint64_t deadline = sent + m_rack_rtt + reo_wnd;
+        if (deadline <= now)
+        {
+            segment.set_lost(true);
+            marked = true;
+        }
+        else if (m_reorder_deadline == 0 || deadline < m_reorder_deadline)
+        {
+            m_reorder_deadline = deadline;
+        }
+    }
+    return marked;
+}
+
+void Server_connection::enter_recovery()
+{
+    m_in_recovery = true;
+    m_recovery_end = m_seq_num;
+    m_recover_fs = flight_size();
+    m_prr_delivered = 0;
+    m_prr_out = 0;
+    m_ssthresh = max((uint16_t) (m_recover_fs / 2), (uint16_t) (2 * m_mss));
+    m_slow_start = false;
+    if (++m_recoveries >= RACK_REO_DECAY)
+    {
+        m_reordering = false;
+        m_reo_mult = 1;
+        m_recoveries = 0;
+    }
+}
+
+// RFC 6937: while more than ssthresh is in flight send in proportion to
+// what is delivered, so cwnd lands on ssthresh as recovery ends instead of
+// halving at once; below it, grow back like slow start, but never in a
+// burst bigger than what was delivered plus one segment
+void Server_connection::update_prr(uint32_t delivered)
+{
+    m_prr_delivered += delivered;
+    uint32_t in_flight = pipe();
+    int64_t sndcnt;
+    if (in_flight > m_ssthresh)
+    {
+        uint64_t allowed = ((uint64_t) m_prr_delivered * m_ssthresh + m_recover_fs - 1) / max(m_recover_fs, (uint32_t) 1);
+        sndcnt = (int64_t) allowed - m_prr_out;
+    }
+    else
+    {
+        int64_t limit = max((int64_t) m_prr_delivered - m_prr_out, (int64_t) delivered) + m_mss;
+        sndcnt = min((int64_t) m_ssthresh - in_flight, limit);
+    }
+
+    // the first retransmission goes out whatever the arithmetic says
+    if (m_prr_out == 0)
+        sndcnt = max(sndcnt, (int64_t) m_mss);
+    m_cwnd = in_flight + max(sndcnt, (int64_t) 0);
+}
+
+// HyStart (RFC 9406): compare the lowest RTT of the first few ACKs of each
+// round with the last round's, and leave slow start once queues build
+void Server_connection::on_rtt_sample(uint64_t rtt)
+{
+    if (!m_slow_start || m_round_samples >= m_round_need)
+        return;
+    m_round_min = m_round_samples == 0 ? rtt : min(m_round_min, rtt);
+    m_round_samples++;
+    if (m_round_samples < m_round_need || m_last_round_min == 0)
+        return;
+
+    uint64_t eta = min(max(m_last_round_min / 8, HYSTART_MIN_ETA), HYSTART_MAX_ETA);
+    if (m_round_min >= m_last_round_min + eta)
+    {
+        m_ssthresh = m_cwnd;
+        m_slow_start = false;
+        m_cwd_pkts = m_cwnd / m_mss;
+        m_pkts_sent = 0;
+        m_delay_exits++;
+        if (m_log != NULL)
+            *m_log << "Leaving slow start at cwnd " << m_cwnd << ", rtt " << m_round_min << " us" << endl;
+    }
+}
+
+// bytes in the network: sent, not acked, not known delivered or lost
+uint32_t Server_connection::pipe() const
+{
+    uint32_t in_flight = 0;
+    for (const auto &i : m_window)
+    {
+        if (!i.second.delivered() && !i.second.lost())
+            in_flight += i.second.data_len();
+    }
+    return in_flight;
+}
+
+// when the oldest segment in the network times out, 0 if none is; one
+// counted as lost has no timer until it is sent again, or every segment
+// behind a timeout would time out in turn as the ACKs reach it
+uint64_t Server_connection::rto_deadline() const
+{
+    uint64_t deadline = 0;
+    for (const auto &i : m_window)
+    {
+        const Packet_info &segment = i.second;
+        if (!segment.delivered() && !segment.lost() && (deadline == 0 || segment.get_max_time() < deadline))
+            deadline = segment.get_max_time();
+    }
+    return deadline;
+}
+
+// a round yields one sample per segment in flight when it starts, and
+// the window holds few of them, so ask for no more than that (RFC 9406
+// wants 8)
+uint16_t Server_connection::hystart_samples() const
+{
+    uint16_t segments = flight_size() / m_mss;
+    return min(HYSTART_MIN_SAMPLES, max(HYSTART_FEW_SAMPLES, segments));
+}
+
+// sequence space between the cumulative ACK and the next new segment
+uint16_t Server_connection::flight_size() const
+{
+    return (m_seq_num + MSN - m_base_num) % MSN;
+}
+
+// true if sequence number a is later than b, both within the window
+bool Server_connection::newer(uint16_t a, uint16_t b) const
+{
+    return (m_seq_num + MSN - a) % MSN < (m_seq_num + MSN - b) % MSN;
+}
+
+void Server_connection::on_challenge_timeout()
+{
+    if (m_challenges < MAX_CHALLENGES)
+    {
+        m_send_challenge = true;
+        return;
+    }
+
+    // the new address is not the client's after all, nothing was touched
+    // while it was being validated so there is nothing to undo
+    m_validating = false;
+    if (m_log != NULL)
+        *m_log << "Path validation failed" << endl;
+    m_events.push_back({EVENT_PATH_FAILED, "", false});
+}
+
+void Server_connection::on_path_response(const char *data, size_t data_len, uint64_t now)
+{
+    uint64_t token;
+    if (!m_validating || data_len != PATH_TOKEN_LEN)
+        return;
+    memcpy(&token, data, PATH_TOKEN_LEN);
+    if (token != m_path_token)
+        return;
+
+    // a new host is a new path: what was learned about the old one,
+    // segment size included, says nothing about it
+    if (m_new_host)
+    {
+        reset_path(now);
+        restart_pmtu();
+    }
+
+    // an answer to the only challenge sent is a clean RTT sample
+    if (m_challenges == 1)
+        m_rto.update_RTO(m_challenge.get_time_sent(), now);
+    m_validating = false;
+    if (m_log != NULL)
+        *m_log << "Path validated" << (m_new_host ? ", new host, segment size " + to_string(m_mss) : "") << endl;
+
+    // whatever is still in flight went to the old address, resend it at
+    // once instead of waiting for it to time out, without counting it as
+    // congestion
+    for (auto &i : m_window)
+    {
+        if (i.second.delivered())
+            continue;
+        i.second.set_lost(true);
+        i.second.update_time(now, m_rto.get_timeout());
+    }
+    m_dup_ack = 0;
+    m_reorder_deadline = 0;
+    m_events.push_back({EVENT_PATH_VALIDATED, "", false});
+}
+
+// a new host is a new path, start it the way a new connection would
+void Server_connection::reset_path(uint64_t now)
+{
+    m_rto = RTO();
+    m_cwnd = min((double) m_mss, MSN / 2.0);
+    m_ssthresh = INITIAL_SSTHRESH;
+    m_slow_start = true;
+    m_backoffs = 0;
+    m_in_recovery = false;
+    m_dup_ack = 0;
+    m_reorder_deadline = 0;
+    m_rack_rtt = 0;
+    m_min_rtt = 0;
+    m_reordering = false;
+    m_reo_mult = 1;
+    m_round_min = 0;
+    m_last_round_min = 0;
+    m_round_samples = 0;
+    m_round_need = HYSTART_FEW_SAMPLES;
+    m_seeded = false;
+    m_delivered = 0;
+    m_busy_us = 0;
+    m_busy_start = now;
+}
+
+// back to DEFAULT_MSS and a new search, with every segment still to be
+// sent again cut down to the new size
+void Server_connection::restart_pmtu()
+{
+    m_pmtu.restart();
+    m_mss = m_pmtu.mss();
+    m_cwnd = min(m_cwnd, (double) m_mss);
+    for (uint16_t seq = m_base_num; seq != m_seq_num; )
+    {
+        auto found = m_window.find(seq);
+        if (found == m_window.end())
+            break;
+        Packet_info segment = found->second;
+        uint16_t len = segment.data_len();
+        if (len > m_mss && !segment.delivered())
+        {
+            char data[MAX_MSS];
+            segment.pkt().data(data, len);
+            m_window.erase(found);
+            for (uint16_t off = 0; off < len; off += m_mss)
+            {
+                uint16_t piece_len = min((uint16_t) (len - off), m_mss);
+                uint16_t piece_seq = (seq + off) % MSN;
+                Packet p(0, 0, 0, piece_seq, segment.pkt().ack_num(), 0, data + off, piece_len);
+                p.set_conn_id(m_conn_id);
+                Packet_info piece(p, piece_len, segment.get_time_sent(), segment.get_max_time() - segment.get_time_sent());
+                piece.set_retransmitted();
+                piece.set_lost(segment.lost());
+                m_window.emplace(piece_seq, piece);
+            }
+        }
+        seq = (seq + len) % MSN;
+    }
+}
+
+void Server_connection::on_probe_ack(const Packet &p, size_t data_len)
+{
+    uint16_t probe_size = 0;
+    if (data_len >= sizeof(probe_size))
+    {
+        p.data((char *) &probe_size, sizeof(probe_size));
+    }
+    if (m_pmtu.probe_acked(ntohs(probe_size)))
+    {
+        m_mss = m_pmtu.mss();
+        m_cwnd = max(m_cwnd, (double) m_mss); // room for at least one segment of the new size
+        m_ssthresh = max(m_ssthresh, m_mss);
+        if (m_log != NULL)
+            *m_log << "Path MTU probe acked, segment size " << m_mss << endl;
+    }
+}
+
+// every byte of the response is acked: mark the end of file if the client
+// has another request, otherwise start closing
+void Server_connection::finish_response()
+{
+    if (m_more)
+    {
+        Packet p(0, 0, 0, m_seq_num, m_ack_num, 0, "", 0);
+        p.set_more(true);
+        send_control(p, 0);
+        if (m_log != NULL)
+            *m_log << "Sending packet " << m_seq_num << " EOF" << endl;
+        m_state = EOF_SENT;
+    }
+    else
+    {
+        send_control(Packet(0, 0, 1, m_seq_num, m_ack_num, 0, "", 0), 0);
+        if (m_log != NULL)
+            *m_log << "Sending packet " << m_seq_num << " FIN" << endl;
+        m_state = FIN_SENT;
+    }
+    m_seq_num = (m_seq_num + 1) % MSN; // end of file and FIN take up 1 sequence
+    m_base_num = m_seq_num;
+}
+
+void Server_connection::send_control(const Packet &p, uint16_t data_len)
+{
+    Packet control = p;
+    control.set_conn_id(m_conn_id);
+    m_control = Packet_info(control, data_len, 0, 0);
+    m_send_control = true;
+}
+
+bool Server_connection::valid_ack(const Packet &p) const
+{
+    uint16_t ack = p.ack_num();
+    uint16_t max = (m_base_num + MSN/2) % MSN;
+
+    if (m_base_num < max) // no overflow of window
+    {
+        return ack >= m_base_num && ack <= max;
+    }
+    else // window overflowed
+    {
+        return !(ack > max && ack < m_base_num);
+    }
+}
+
+bool Server_connection::update_window(const Packet &p, uint64_t now, uint16_t &n_removed, uint32_t &delivered)
+{
+    n_removed = 0;
+    while (m_base_num != p.ack_num())
+    {
+        auto found = m_window.find(m_base_num);
+        if (found == m_window.end())
+        {
+            fail("could not find base_num packet " + to_string(m_base_num) + " for ack num " + to_string(p.ack_num()) + " in window");
+            return false;
+        }
+
+        // a retransmitted segment's ACK could be for either copy (Karn)
+        const Packet_info &segment = found->second;
+        if (!segment.retransmitted())
+        {
+            m_rto.update_RTO(segment.get_time_sent(), now);
+            on_rtt_sample(now - segment.get_time_sent());
+        }
+        if (!segment.delivered())
+        {
+            delivered += segment.data_len();
+            on_delivered(segment, m_base_num, now);
+        }
+        uint16_t len = segment.data_len();
+        m_window.erase(found);
+        n_removed += len;
+        m_base_num = (m_base_num + len) % MSN;
+    }
+    m_delivered += n_removed;
+    if (m_window.size() == 0)
+        m_busy_us += now - m_busy_start;
+
+    // a HyStart round ends when the data sent at its start is acked
+    uint16_t left = (m_round_end + MSN - m_base_num) % MSN;
+    if (left == 0 || left > MSN/2)
+    {
+        if (m_round_samples >= m_round_need)
+            m_last_round_min = m_round_min;
+        m_round_samples = 0;
+        m_round_end = m_seq_num;
+        m_round_need = hystart_samples();
+    }
+    return true;
+}
+
+// RTO from the cached RTT, ssthresh as it was, and a first window of one
+// bandwidth-delay product, never above ssthresh so a path that has got
+// worse since only costs one round of losses
+void Server_connection::apply_seed()
+{
+    m_rto.seed(m_seed.srtt, m_seed.rttvar);
+    m_ssthresh = max(min(m_seed.ssthresh, (uint16_t) (MSN / 2)), m_mss);
+    double bdp = (double) m_seed.bandwidth * m_seed.srtt / 1000000;
+    m_cwnd = max(min(bdp, (double) m_ssthresh), (double) m_mss);
+    if (m_log != NULL)
+        *m_log << "Seeded from path cache, rtt " << m_seed.srtt << " us, cwnd " << m_cwnd << ", ssthresh " << m_ssthresh << endl;
+    if (m_cwnd >= m_ssthresh)
+    {
+        m_slow_start = false;
+        m_cwd_pkts = m_cwnd / m_mss;
+        m_pkts_sent = 0;
+    }
+}
+
+void Server_connection::fail(const string &what)
+{
+    m_state = CLOSED;
+    m_events.push_back({EVENT_ERROR, what, false});
+}
+
+// one more timeout without hearing back: backs the timer off, or closes
+// the connection once max_backoffs have gone by and returns true
+bool Server_connection::give_up(uint16_t max_backoffs)
+{
+    if (m_backoffs < max_backoffs)
+    {
+        m_backoffs++;
+        m_rto.double_RTO();
+        return false;
+    }
+    if (m_log != NULL)
+        *m_log << "No answer after " << m_backoffs << " retransmissions, closing" << endl;
+    m_state = CLOSED;
+    m_validating = false;
+    m_events.push_back({EVENT_TIMED_OUT, "", false});
+    return true;
+}
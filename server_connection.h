@@ -0,0 +1,203 @@
+#ifndef SERVER_CONNECTION_H
+#define SERVER_CONNECTION_H
+
+#include "packet.h"
+#include "pmtu.h"
+#include "transport.h"
+#include "cookie.h"
+#include <string> // for string
+#include <deque> // for deque
+#include <unordered_map> // for map
+#include <ostream> // for ostream
+
+const uint16_t DUP_THRESH = 3; // duplicate ACKs that mean loss from a client that does not echo segments
+const uint16_t HYSTART_MIN_SAMPLES = 8; // RTT samples per round before the delay check counts
+const uint16_t HYSTART_FEW_SAMPLES = 3; // what will do while cwnd holds fewer than HYSTART_MIN_SAMPLES segments
+const uint64_t HYSTART_MIN_ETA = 4000; // us, RTT increase that ends slow start, at least
+const uint64_t HYSTART_MAX_ETA = 16000; // us, and at most
+const uint32_t RACK_MAX_REO_MULT = 8; // reordering window grows to this many quarter min RTTs, capped at srtt
+const uint32_t RACK_REO_DECAY = 16; // recoveries without reordering before the window shrinks back
+const uint16_t MAX_CHALLENGES = 3; // unanswered path challenges before going back to the old address
+const uint16_t MAX_SYN_ACKS = 5; // SYN ACK retransmissions, about a minute with backoff, before a silent client is dropped
+const uint16_t MAX_BACKOFFS = 8; // timeouts in a row on data, EOF or FIN before the client counts as gone
+
+// server side of one connection: answers the SYN, streams each response
+// the application write()s under congestion control, and closes once the
+// client asks for nothing more
+class Server_connection
+{
+public:
+    // conn_id is what the client puts in every packet after the SYN, the
+    // caller picks it unique among its connections and hard to guess
+    Server_connection(uint16_t isn, uint64_t cookie, bool probing, uint32_t conn_id);
+
+    // log lines like the ones the server binary prints, NULL for none
+    void set_log(std::ostream *log);
+
+    // start from an earlier connection's view of the path instead of the
+    // defaults, call before the SYN arrives or right after EVENT_PATH_VALIDATED
+    void seed_path(const Path_metrics &metrics);
+
+    // this connection's view of the path, false if it has no RTT sample yet
+    bool path_metrics(Path_metrics &metrics, uint64_t now) const;
+
+    void on_datagram(const char *buf, size_t len, uint64_t now);
+    bool poll_transmit(Transmit &t, uint64_t now);
+
+    // buf came from an address other than the validated one: returns true
+    // if that address is now being validated, so Transmits with challenge
+    // set go there and what it sends, buf included, goes to on_datagram()
+    // until EVENT_PATH_VALIDATED or EVENT_PATH_FAILED; everything else is
+    // still sent to the validated address, a replayed datagram costs no
+    // more than a few challenges, and an address that turns up later
+    // takes over from one not yet validated. Returns false, and buf is
+    // dropped, if it is older than what has been heard already. Only once
+    // the echo arrives, and unless only the port changed (NAT rebinding),
+    // do congestion control, the RTT estimate and the path MTU start over
+    bool on_path_change(const char *buf, size_t len, uint64_t token, bool same_host, uint64_t now);
+    void on_send_error(const Transmit &t, int err);
+
+    // absolute time on_timeout() wants to be called at, 0 if none
+    uint64_t next_timeout() const;
+    void on_timeout(uint64_t now);
+
+    bool poll_event(Event &e);
+
+    // response bytes for the current request; a short last segment waits
+    // for more writes until flush() or end_response(), like Nagle in TCP
+    size_t writable() const;
+    size_t write(const char *data, size_t len);
+    void flush();
+    void end_response();
+
+    bool closed() const;
+    double cwnd() const;
+    uint16_t ssthresh() const;
+    uint16_t mss() const;
+    uint32_t retransmits() const;
+    uint32_t timeouts() const;
+    uint32_t delay_exits() const; // slow starts HyStart ended on a rising RTT
+
+private:
+    enum State
+    {
+        LISTEN,
+        SYN_RCVD,
+        ESTABLISHED,
+        EOF_SENT,
+        FIN_SENT,
+        TIME_WAIT,
+        CLOSED
+    };
+
+    void accept(const Packet &p, size_t data_len);
+    void on_ack(const Packet &p, size_t data_len, uint64_t now);
+    void on_probe_ack(const Packet &p, size_t data_len);
+    void on_path_response(const char *data, size_t data_len, uint64_t now);
+    void on_challenge_timeout();
+    void reset_path(uint64_t now);
+    void restart_pmtu();
+    void finish_response();
+    void send_control(const Packet &p, uint16_t data_len);
+    bool valid_ack(const Packet &p) const;
+    bool update_window(const Packet &p, uint64_t now, uint16_t &n_removed, uint32_t &delivered);
+    void fail(const std::string &what);
+    bool give_up(uint16_t max_backoffs);
+    void apply_seed();
+    void on_delivered(const Packet_info &segment, uint16_t seq_num, uint64_t now);
+    bool detect_loss(uint64_t now);
+    void enter_recovery();
+    void update_prr(uint32_t delivered);
+    void on_rtt_sample(uint64_t rtt);
+    uint32_t pipe() const;
+    uint64_t rto_deadline() const;
+    uint64_t state_timeout() const;
+    uint16_t hystart_samples() const;
+    uint16_t flight_size() const;
+    bool newer(uint16_t a, uint16_t b) const;
+
+    State         m_state;
+    std::ostream *m_log;
+    uint32_t      m_conn_id;
+    uint64_t      m_cookie;
+    bool          m_probing;
+    Pmtu          m_pmtu;
+    RTO           m_rto;
+
+    uint16_t m_mss;
+    uint16_t m_seq_num;
+    uint16_t m_ack_num;
+    uint16_t m_base_num;
+    uint16_t m_prev_ack;
+    uint16_t m_handshake_seq; // seq_num of the client's ACK after SYN ACK
+    bool     m_more; // client will send another request after this one
+    bool     m_response_ended;
+    size_t   m_push_len; // unsent bytes flush() wants out without filling a segment
+
+    std::string m_send_buf; // written but not yet in a segment
+    size_t      m_send_pos;
+    std::unordered_map<uint16_t, Packet_info> m_window;
+
+    Packet_info m_syn_ack;
+    bool        m_send_syn_ack;
+    Packet_info m_control; // last EOF, FIN or final ACK
+    bool        m_send_control;
+    uint64_t    m_time_wait_end;
+
+    // path validation: after the client's address changes only the
+    // challenge goes out, and the other timers wait, until it is echoed
+    bool        m_validating;
+    uint64_t    m_path_token;
+    Packet_info m_challenge;
+    bool        m_send_challenge;
+    uint16_t    m_challenges; // sent with the current token
+    bool        m_new_host;   // the address being validated is on another host
+
+    double   m_cwnd;
+    uint16_t m_ssthresh;
+    uint16_t m_cwd_pkts;
+    uint16_t m_pkts_sent;
+    uint16_t m_dup_ack;
+    uint16_t m_recv_window;
+    bool     m_slow_start;
+    uint16_t m_backoffs; // RTOs in a row without a new ACK
+
+    // proportional rate reduction (RFC 6937) while repairing losses
+    bool     m_in_recovery;
+    uint16_t m_recovery_end; // recovery is over once this is acked
+    uint32_t m_recover_fs; // bytes in flight when recovery started
+    uint32_t m_prr_delivered;
+    uint32_t m_prr_out;
+
+    // RACK (RFC 8985): a segment is lost once one sent after it has been
+    // delivered and a reordering window has passed
+    uint64_t m_rack_xmit; // send time of the most recently sent segment known delivered
+    uint16_t m_rack_end; // and where it ends, to order segments sent at the same time
+    uint64_t m_rack_rtt;
+    uint64_t m_min_rtt;
+    bool     m_reordering; // seen since the window was last reset
+    uint32_t m_reo_mult;
+    uint64_t m_reo_raised;
+    uint32_t m_recoveries; // since the reordering window last grew
+    uint64_t m_reorder_deadline; // when a segment now in doubt counts as lost, 0 if none
+
+    // HyStart: leave slow start once a round's RTT climbs over the last one's
+    uint16_t m_round_end;
+    uint64_t m_round_min;
+    uint64_t m_last_round_min;
+    uint16_t m_round_samples;
+    uint16_t m_round_need; // samples this round's minimum needs to count
+
+    uint32_t m_retransmits; // segments sent again, for either reason
+    uint32_t m_timeouts;
+    uint32_t m_delay_exits;
+
+    Path_metrics m_seed;
+    bool         m_seeded;
+    uint64_t     m_delivered; // bytes acked
+    uint64_t     m_busy_us; // time with data in flight, before m_busy_start
+    uint64_t     m_busy_start; // when the window last went from empty to not
+
+    std::deque<Event> m_events;
+};
+#endif
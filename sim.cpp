@@ -0,0 +1,512 @@
+#include "server_connection.h"
+#include "client_connection.h"
+#include "path_cache.h"
+#include <iostream> // for cout
+#include <string> // for string
+#include <vector> // for vector
+#include <queue> // for priority_queue
+#include <deque> // for deque
+#include <set> // for set
+#include <sstream> // for istringstream
+#include <cstdlib> // for strtod, strtoull
+#include <cmath> // for ceil
+#include <getopt.h> // for getopt
+
+using namespace std;
+
+const uint64_t MAX_SIM_TIME = 3600000000ULL; // us, give up on a transfer after an hour of virtual time
+const uint32_t MAX_IDLE_STEPS = 1000; // steps without the clock moving before we call it a livelock
+const uint16_t IP_UDP_HEADER_LEN = 28; // bytes on top of each datagram against the link MTU
+const uint32_t REPLAY_ADDR = 0x7fff0000; // another host, where replayed datagrams come from
+
+// xorshift64*, so a seed always gives the same losses on every host
+class Rng
+{
+public:
+    Rng(uint64_t seed)
+    {
+        m_state = seed != 0 ? seed : 1;
+    }
+
+    // uniform in [0, 1)
+    double next()
+    {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return ((m_state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / (1ULL << 53));
+    }
+
+private:
+    uint64_t m_state;
+};
+
+struct Datagram
+{
+    uint64_t arrival; // us
+    uint64_t order; // ties are delivered in send order
+    bool     to_client;
+    uint32_t addr; // client address it comes from or goes to, host << 16 | port
+    string   data;
+};
+
+struct Arrives_later
+{
+    bool operator()(const Datagram &a, const Datagram &b) const
+    {
+        return a.arrival != b.arrival ? a.arrival > b.arrival : a.order > b.order;
+    }
+};
+
+// one direction of the path: a drop-tail queue in front of a fixed rate
+// bottleneck, then a fixed propagation delay
+class Link
+{
+public:
+    Link(uint64_t delay, double bytes_per_us, size_t queue_limit, uint16_t mtu, double loss, const set<uint32_t> &drops,
+         double reorder, uint64_t reorder_delay)
+    {
+        m_delay = delay;
+        m_reorder = reorder;
+        m_reorder_delay = reorder_delay;
+        m_bytes_per_us = bytes_per_us;
+        m_queue_limit = queue_limit;
+        m_mtu = mtu;
+        m_loss = loss;
+        m_drops = drops;
+        m_free_at = 0;
+        m_sent = 0;
+        m_dropped = 0;
+    }
+
+    // returns false if the datagram is lost, otherwise when it arrives
+    bool send(size_t len, uint64_t now, Rng &rng, uint64_t &arrival)
+    {
+        uint32_t n = m_sent++;
+        while (!m_queue.empty() && m_queue.front() <= now)
+        {
+            m_queue.pop_front();
+        }
+
+        bool lost = m_drops.count(n) != 0 || rng.next() < m_loss ||
+                    len + IP_UDP_HEADER_LEN > m_mtu || m_queue.size() >= m_queue_limit;
+        if (lost)
+        {
+            m_dropped++;
+            return false;
+        }
+
+        uint64_t start = max(now, m_free_at);
+        m_free_at = start + (m_bytes_per_us > 0 ? (uint64_t) ((len + IP_UDP_HEADER_LEN) / m_bytes_per_us) : 0);
+        m_queue.push_back(m_free_at);
+        arrival = m_free_at + m_delay;
+        if (m_reorder > 0 && rng.next() < m_reorder)
+            arrival += m_reorder_delay; // held up on another path, later datagrams overtake it
+        return true;
+    }
+
+    // a route change, for what is sent from now on
+    void set_mtu(uint16_t mtu)
+    {
+        m_mtu = mtu;
+    }
+
+    uint32_t sent() const
+    {
+        return m_sent;
+    }
+
+    uint32_t dropped() const
+    {
+        return m_dropped;
+    }
+
+private:
+    uint64_t         m_delay;
+    double           m_bytes_per_us;
+    size_t           m_queue_limit;
+    uint16_t         m_mtu;
+    double           m_loss;
+    double           m_reorder;
+    uint64_t         m_reorder_delay; // us
+    set<uint32_t>    m_drops; // datagram numbers to lose, counted from 0
+    uint64_t         m_free_at; // when the bottleneck finishes what it has
+    deque<uint64_t>  m_queue; // departure times of datagrams still queued
+    uint32_t         m_sent;
+    uint32_t         m_dropped;
+};
+
+struct Sim_options
+{
+    Sim_options()
+    {
+        n_bytes = 10485760;
+        rtt_ms = 20;
+        mbit = 100;
+        queue_limit = 100;
+        mtu = 1500;
+        loss = ack_loss = 0;
+        reorder = 0;
+        reorder_ms = -1;
+        seed = 1;
+        move_at = 0;
+        move_host = false;
+        moved_mtu = 0;
+        replay_at = 0;
+        read_mbit = 0;
+        fast_open = false;
+        trace = false;
+        verbose = false;
+    }
+
+    uint64_t      n_bytes;
+    double        rtt_ms;
+    double        mbit;
+    size_t        queue_limit;
+    uint16_t      mtu;
+    double        loss; // 0 to 1, so is ack_loss
+    double        ack_loss;
+    double        reorder;
+    double        reorder_ms; // -1 for an eighth of the RTT
+    set<uint32_t> drops;
+    set<uint32_t> ack_drops;
+    uint64_t      seed;
+    uint32_t      move_at; // client datagram the move happens before, 0 for none
+    bool          move_host;
+    uint16_t      moved_mtu; // link MTU after the move, 0 to keep it
+    uint32_t      replay_at; // client datagram replayed from REPLAY_ADDR, 0 for none
+    double        read_mbit; // how fast the client application reads, 0 for at once
+    bool          fast_open;
+    bool          trace;
+    bool          verbose;
+};
+
+int simulate(const Sim_options &o, const Path_metrics *cached, Path_metrics *learned);
+char pattern(uint64_t offset);
+set<uint32_t> parse_drops(const string &list);
+
+int main(int argc, char* argv[])
+{
+    Sim_options o;
+    bool cached = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:b:q:m:l:k:d:a:o:e:p:P:M:R:w:s:fctv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': o.n_bytes = strtoull(optarg, NULL, 10); break;
+        case 'r': o.rtt_ms = strtod(optarg, NULL); break;
+        case 'b': o.mbit = strtod(optarg, NULL); break;
+        case 'q': o.queue_limit = strtoull(optarg, NULL, 10); break;
+        case 'm': o.mtu = strtoul(optarg, NULL, 10); break;
+        case 'l': o.loss = strtod(optarg, NULL) / 100; break;
+        case 'k': o.ack_loss = strtod(optarg, NULL) / 100; break;
+        case 'd': o.drops = parse_drops(optarg); break;
+        case 'a': o.ack_drops = parse_drops(optarg); break;
+        case 'o': o.reorder = strtod(optarg, NULL) / 100; break;
+        case 'e': o.reorder_ms = strtod(optarg, NULL); break;
+        case 'p': o.move_at = strtoul(optarg, NULL, 10); o.move_host = false; break;
+        case 'P': o.move_at = strtoul(optarg, NULL, 10); o.move_host = true; break;
+        case 'M': o.moved_mtu = strtoul(optarg, NULL, 10); break;
+        case 'R': o.replay_at = strtoul(optarg, NULL, 10); break;
+        case 'w': o.read_mbit = strtod(optarg, NULL); break;
+        case 's': o.seed = strtoull(optarg, NULL, 10); break;
+        case 'f': o.fast_open = true; break;
+        case 'c': cached = true; break;
+        case 't': o.trace = true; break;
+        case 'v': o.verbose = true; break;
+        default:
+            cout << "Usage: " << argv[0] << " [-n BYTES] [-r RTT-MS] [-b MBIT/S] [-q QUEUE-PACKETS] [-m MTU]" << endl;
+            cout << "       [-l LOSS-%] [-k ACK-LOSS-%] [-d DROP,...] [-a ACK-DROP,...]" << endl;
+            cout << "       [-o REORDER-%] [-e REORDER-MS] [-p DATAGRAM | -P DATAGRAM] [-M MTU] [-R DATAGRAM] [-w MBIT/S] [-s SEED] [-f] [-c] [-t] [-v]" << endl;
+            return 1;
+        }
+    }
+
+    // what an earlier transfer over the same link left in the path cache,
+    // taken from it the way the server does
+    Path_metrics metrics;
+    if (cached)
+    {
+        Sim_options earlier = o;
+        earlier.trace = false;
+        earlier.verbose = false;
+        Path_metrics learned;
+        if (simulate(earlier, NULL, &learned) != 0)
+            return 1;
+        Path_cache paths;
+        paths.update("sim", 0, learned);
+        paths.lookup("sim", 0, metrics);
+    }
+    return simulate(o, cached ? &metrics : NULL, NULL);
+}
+
+// one transfer over the link o describes, seeded from cached if not NULL;
+// with learned, the server's view of the path ends up there instead of
+// the results being printed
+int simulate(const Sim_options &o, const Path_metrics *cached, Path_metrics *learned)
+{
+    Rng rng(o.seed);
+    uint64_t delay = o.rtt_ms * 500; // one way, us
+    double bytes_per_us = o.mbit / 8;
+    uint64_t reorder_delay = o.reorder_ms >= 0 ? o.reorder_ms * 1000 : o.rtt_ms * 125; // an eighth of the RTT by default
+    Link to_client(delay, bytes_per_us, o.queue_limit, o.mtu, o.loss, o.drops, o.reorder, reorder_delay);
+    Link to_server(delay, bytes_per_us, o.queue_limit, o.mtu, o.ack_loss, o.ack_drops, 0, 0);
+    priority_queue<Datagram, vector<Datagram>, Arrives_later> in_flight;
+    uint64_t order = 0;
+
+    const uint64_t cookie = 0x5eed5eed5eed5eedULL;
+    Server_connection server(o.seed % MSN, cookie, true, 0xc0ffee);
+    Client_connection client((o.seed * 7) % MSN, o.fast_open ? cookie : 0, "sim", false);
+    if (o.verbose)
+    {
+        server.set_log(&cout);
+        client.set_log(&cout);
+    }
+    if (cached != NULL)
+        server.seed_path(*cached);
+
+    uint64_t now = 0, done_at = 0, read_at = 0;
+    double read_credit = 0; // bytes a slow application may read by now
+    uint64_t written = 0, received = 0;
+    bool responding = false;
+    double last_cwnd = 0;
+    uint16_t last_ssthresh = 0;
+    uint32_t idle_steps = 0;
+
+    // the client's address, the validated one the server sends to, and
+    // the one it is challenging; a move happens before the client's
+    // o.move_at'th datagram
+    uint32_t client_addr = 0, server_peer = 0, candidate_peer = 0;
+    bool challenging = false;
+    uint64_t moved_at = 0, validated_at = 0, replayed_at = 0, failed_at = 0, tokens = 0;
+    uint32_t lost_to_old = 0;
+    vector<char> buffer(SEND_BUFFER);
+    uint64_t wall_start = now_us();
+    while (!server.closed() || !client.closed())
+    {
+        server.on_timeout(now);
+        client.on_timeout(now);
+
+        Event e;
+        while (server.poll_event(e))
+        {
+            if (e.type == EVENT_REQUEST)
+                responding = true;
+            else if (e.type == EVENT_PATH_VALIDATED)
+            {
+                server_peer = candidate_peer;
+                challenging = false;
+                validated_at = now;
+            }
+            else if (e.type == EVENT_PATH_FAILED)
+            {
+                challenging = false;
+                failed_at = now;
+            }
+            else if (e.type == EVENT_ERROR)
+            {
+                cerr << "server error at " << now / 1000.0 << " ms: " << e.name << endl;
+                return 1;
+            }
+            else if (e.type == EVENT_TIMED_OUT)
+            {
+                cerr << "server gave up on the client at " << now / 1000.0 << " ms" << endl;
+                return 1;
+            }
+        }
+        while (client.poll_event(e))
+        {
+            if (e.type == EVENT_ERROR)
+            {
+                cerr << "client error at " << now / 1000.0 << " ms: " << e.name << endl;
+                return 1;
+            }
+        }
+
+        // the response is a known pattern so the client side can check it
+        while (responding && server.writable() != 0)
+        {
+            size_t len = min((uint64_t) min(buffer.size(), server.writable()), o.n_bytes - written);
+            for (size_t i = 0; i < len; i++)
+            {
+                buffer[i] = pattern(written + i);
+            }
+            written += server.write(&buffer[0], len);
+            if (written == o.n_bytes)
+            {
+                server.end_response();
+                responding = false;
+            }
+        }
+        size_t len, max_read = buffer.size();
+        if (o.read_mbit != 0)
+        {
+            read_credit = min(read_credit + (now - read_at) * o.read_mbit / 8, (double) buffer.size());
+            read_at = now;
+            max_read = read_credit;
+        }
+        while (max_read != 0 && (len = client.read(&buffer[0], max_read)) != 0)
+        {
+            max_read -= len;
+            if (o.read_mbit != 0)
+                read_credit -= len;
+            for (size_t i = 0; i < len; i++)
+            {
+                if (buffer[i] != pattern(received + i))
+                {
+                    cerr << "corrupt byte at offset " << received + i << endl;
+                    return 1;
+                }
+            }
+            received += len;
+            if (received == o.n_bytes)
+                done_at = now;
+        }
+
+        Transmit t;
+        uint64_t arrival;
+        while (server.poll_transmit(t, now))
+        {
+            if (to_client.send(t.len, now, rng, arrival))
+                in_flight.push({arrival, order++, true, t.challenge ? candidate_peer : server_peer, string((const char *) &t.pkt, t.len)});
+        }
+        while (client.poll_transmit(t, now))
+        {
+            // a NAT rebinding changes the port behind the client's back, a
+            // new interface the host, and the client knows about that one
+            if (o.move_at != 0 && moved_at == 0 && to_server.sent() + 1 >= o.move_at)
+            {
+                client_addr += o.move_host ? 1 << 16 : 1;
+                moved_at = now;
+                if (o.move_host)
+                    client.on_path_change();
+                if (o.moved_mtu != 0) // the new path's MTU, or a route change under a NAT
+                {
+                    to_client.set_mtu(o.moved_mtu);
+                    to_server.set_mtu(o.moved_mtu);
+                }
+            }
+            bool replay = to_server.sent() + 1 == o.replay_at;
+            if (!to_server.send(t.len, now, rng, arrival))
+                continue;
+            // someone who saw it on the way sends a copy from elsewhere
+            // that gets there first
+            if (replay)
+                in_flight.push({arrival, order++, false, REPLAY_ADDR, string((const char *) &t.pkt, t.len)});
+            in_flight.push({arrival, order++, false, client_addr, string((const char *) &t.pkt, t.len)});
+        }
+
+        if (o.trace && (server.cwnd() != last_cwnd || server.ssthresh() != last_ssthresh))
+        {
+            last_cwnd = server.cwnd();
+            last_ssthresh = server.ssthresh();
+            cout << "trace " << now / 1000.0 << " " << last_cwnd << " " << last_ssthresh << endl;
+        }
+        if (server.closed() && client.closed())
+            break;
+
+        // jump to whatever happens next
+        uint64_t next = 0;
+        if (!in_flight.empty())
+            next = in_flight.top().arrival;
+        uint64_t read_wake = 0; // when a slow application can take another segment's worth
+        if (o.read_mbit != 0 && client.readable() != 0)
+            read_wake = now + (uint64_t) ceil(max(MAX_MSS - read_credit, 1.0) * 8 / o.read_mbit);
+        for (uint64_t deadline : {server.next_timeout(), client.next_timeout(), read_wake})
+        {
+            if (deadline != 0 && (next == 0 || deadline < next))
+                next = deadline;
+        }
+        if (next == 0 || next > MAX_SIM_TIME)
+        {
+            cerr << "transfer stalled at " << now / 1000.0 << " ms with " << received << " of " << o.n_bytes << " bytes" << endl;
+            return 1;
+        }
+        idle_steps = next <= now ? idle_steps + 1 : 0;
+        if (idle_steps > MAX_IDLE_STEPS)
+        {
+            cerr << "no progress at " << now / 1000.0 << " ms" << endl;
+            return 1;
+        }
+        now = max(now, next);
+
+        while (!in_flight.empty() && in_flight.top().arrival <= now)
+        {
+            const Datagram &d = in_flight.top();
+            if (d.to_client && d.addr == REPLAY_ADDR)
+                ; // the replayer does not answer challenges
+            else if (d.to_client && d.addr != client_addr)
+                lost_to_old++; // nobody there any more
+            else if (d.to_client)
+                client.on_datagram(d.data.data(), d.data.size(), now);
+            else if (d.addr == server_peer || (challenging && d.addr == candidate_peer))
+                server.on_datagram(d.data.data(), d.data.size(), now);
+            else if (server.on_path_change(d.data.data(), d.data.size(), 0x70c3e7 + tokens++, d.addr >> 16 == server_peer >> 16, now))
+            {
+                candidate_peer = d.addr;
+                challenging = true;
+                if (d.addr == REPLAY_ADDR)
+                    replayed_at = now;
+                server.on_datagram(d.data.data(), d.data.size(), now);
+            }
+            in_flight.pop();
+        }
+    }
+    uint64_t wall = now_us() - wall_start;
+
+    if (received != o.n_bytes)
+    {
+        cerr << "closed with " << received << " of " << o.n_bytes << " bytes" << endl;
+        return 1;
+    }
+    if (learned != NULL)
+    {
+        if (server.path_metrics(*learned, now))
+            return 0;
+        cerr << "no RTT sample to learn the path from" << endl;
+        return 1;
+    }
+    cout << "transfer: " << o.n_bytes << " bytes in " << done_at / 1000.0 << " ms ("
+         << (done_at != 0 ? o.n_bytes * 1000.0 / done_at : 0) << " KB/s), closed at " << now / 1000.0 << " ms" << endl;
+    cout << "server: " << to_client.sent() << " datagrams, " << server.retransmits() << " retransmits, "
+         << server.timeouts() << " timeouts, " << server.delay_exits() << " delay exits, cwnd " << server.cwnd()
+         << ", ssthresh " << server.ssthresh() << ", mss " << server.mss() << endl;
+    cout << "link: " << to_client.dropped() << " of " << to_client.sent() << " dropped to client, "
+         << to_server.dropped() << " of " << to_server.sent() << " dropped to server" << endl;
+    if (moved_at != 0)
+    {
+        cout << "path: moved at " << moved_at / 1000.0 << " ms, validated at " << validated_at / 1000.0 << " ms, "
+             << lost_to_old << " datagrams lost to the old address" << endl;
+    }
+    if (o.replay_at != 0)
+    {
+        cout << "replay: challenged at " << replayed_at / 1000.0 << " ms, ";
+        if (failed_at != 0)
+            cout << "failed at " << failed_at / 1000.0 << " ms" << endl;
+        else
+            cout << "overtaken by the client" << endl;
+    }
+    cout << "wall: " << wall << " us" << endl;
+    return 0;
+}
+
+// byte at each offset of the simulated response
+char pattern(uint64_t offset)
+{
+    return (char) ((offset * 2654435761ULL) >> 13);
+}
+
+// "3,17,40" to {3, 17, 40}
+set<uint32_t> parse_drops(const string &list)
+{
+    set<uint32_t> drops;
+    istringstream in(list);
+    string n;
+    while (getline(in, n, ','))
+    {
+        if (!n.empty())
+            drops.insert(strtoul(n.c_str(), NULL, 10));
+    }
+    return drops;
+}
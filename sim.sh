@@ -0,0 +1,74 @@
+#!/bin/bash
+# Simulated transfers under scripted loss, all on a virtual clock so the
+# numbers only change when the protocol does. At the default size they
+# are checked against sim.expected and any difference fails the run;
+# after a change that is meant to move them, -u records the new ones.
+# Usage: ./sim.sh [-u] [SIZE-IN-BYTES]
+
+DEFAULT_SIZE=4194304
+EXPECTED=sim.expected
+
+UPDATE=0
+if [ "$1" = "-u" ]
+then
+    UPDATE=1
+    shift
+fi
+SIZE=${1:-$DEFAULT_SIZE}
+
+run()
+{
+    local name=$1
+    shift
+    local output
+    if ! output=$(./sim -n $SIZE "$@")
+    then
+        echo "$name: failed" >&2
+        exit 1
+    fi
+    echo "$name: $(echo "$output" | grep -E '^(transfer|server|path|replay):' | paste -sd ' ')"
+}
+
+scenarios()
+{
+    echo "$SIZE bytes, 20 ms RTT, 100 Mbit/s"
+    run "clean path     "
+    run "cached path    " -c
+    run "single loss    " -d 200
+    run "burst of 5     " -d 200,201,202,203,204
+    run "1% random loss " -l 1
+    run "5% random loss " -l 5
+    run "5% ack loss    " -k 5
+    run "shallow queue  " -q 8
+    run "2% reordering  " -o 2 -e 15
+    run "slow, shallow  " -b 2 -q 4
+    run "slow, deep     " -b 2 -q 100
+    run "NAT rebinding  " -p 500
+    run "new interface  " -P 500
+    run "MTU drop       " -m 9000 -p 500 -M 1500
+    run "new host, MTU  " -m 9000 -P 500 -M 1500
+    run "replayed ACK   " -R 300
+    run "slow reader    " -w 5
+}
+
+make -s sim > /dev/null 2>&1 || { echo "build failed" >&2; exit 1; }
+results=$(scenarios) || exit 1
+echo "$results"
+
+# only the default size has numbers on record
+if [ "$SIZE" != "$DEFAULT_SIZE" ]
+then
+    exit 0
+fi
+if [ $UPDATE -eq 1 ]
+then
+    echo "$results" > $EXPECTED
+    echo "recorded in $EXPECTED"
+    exit 0
+fi
+if ! diff -u $EXPECTED - <<< "$results"
+then
+    echo "results differ from $EXPECTED, run ./sim.sh -u if the change is intended" >&2
+    exit 1
+fi
+echo "all as expected"
@@ -0,0 +1,389 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "cookie.h" // for siphash
+#include "digest.h" // for Sha256
+#include <string> // for string
+#include <vector> // for vector
+#include <unordered_map> // for map
+#include <unordered_set> // for set
+#include <fstream> // for ifstream, ofstream
+#include <sstream> // for ostringstream
+#include <cstdio> // for rename
+#include <dirent.h> // for opendir
+#include <sys/stat.h> // for stat, mkdir
+
+const size_t MIN_CHUNK = 2048; // bytes
+const uint64_t CHUNK_MASK = ((1ULL << 13) - 1) << 51; // top bits, the only ones that see all 64 bytes; 8 KB past MIN_CHUNK on average
+const size_t MAX_CHUNK = 65536; // bytes
+const uint16_t CHUNK_ENTRY_LEN = 12; // hash and length before each chunk in a /chunks reply
+const char SYNC_MANIFEST[] = "/manifest"; // request prefix, real file names never start with /
+const char SYNC_CHUNKS[] = "/chunks";
+const char SYNC_STAGING[] = ".sync"; // client scratch directory inside the sync target
+
+struct Chunk
+{
+    uint64_t hash;
+    uint32_t len;
+};
+
+struct Chunk_location
+{
+    std::string path;
+    uint64_t    offset;
+    uint32_t    len;
+};
+
+struct Manifest_file
+{
+    std::string        path;
+    uint64_t           size;
+    std::string        digest; // SHA-256 of the whole file, in hex
+    std::vector<Chunk> chunks;
+};
+
+typedef std::unordered_map<uint64_t, Chunk_location> Chunk_index;
+
+// a file's chunks, good while the file keeps its inode, size and mtime
+struct Chunked_file
+{
+    ino_t              inode;
+    uint64_t           size;
+    struct timespec    mtime;
+    std::string        digest; // empty until the file is first read
+    std::vector<Chunk> chunks;
+};
+
+// chunked files by full path, so a manifest only rechunks what changed
+typedef std::unordered_map<std::string, Chunked_file> Chunk_cache;
+
+// relative path that stays inside the directory it is resolved against
+inline bool safe_path(const std::string &path)
+{
+    if (path.empty() || path[0] == '/')
+        return false;
+
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        if (path.compare(start, end - start, "..") == 0)
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+// random per-byte values for the gear rolling hash, the same on every host
+inline const uint64_t *gear_table()
+{
+    static uint64_t table[256];
+    static bool filled = false;
+    if (!filled)
+    {
+        uint64_t x = 0x9e3779b97f4a7c15ULL;
+        for (int i = 0; i < 256; i++)
+        {
+            // splitmix64
+            x += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            table[i] = z ^ (z >> 31);
+        }
+        filled = true;
+    }
+    return table;
+}
+
+// content hash, a chunk is identified by this and its length; only 64
+// bits with a fixed key, so files are checked against their digest too
+inline uint64_t chunk_hash(const char *data, size_t len)
+{
+    static const uint8_t key[KEY_LEN] = {0};
+    return siphash(key, (const uint8_t *) data, len);
+}
+
+// splits a file where the gear hash of the last 64 bytes hits the mask,
+// so an insert or delete only changes the chunks around it; bit k of the
+// hash depends on the last k + 1 bytes, hence a mask over the high bits
+// (as in FastCDC); digest, if given, gets the SHA-256 of the whole file
+inline std::vector<Chunk> chunk_file(const std::string &path, std::string *digest = NULL)
+{
+    std::vector<Chunk> chunks;
+    std::ifstream in(path, std::ios::binary);
+    const uint64_t *gear = gear_table();
+    std::vector<char> buffer(1 << 20);
+    std::string current;
+    uint64_t h = 0;
+    Sha256 sha;
+
+    while (in.read(&buffer[0], buffer.size()) || in.gcount() > 0)
+    {
+        size_t n_bytes = in.gcount();
+        size_t start = 0;
+        if (digest != NULL)
+            sha.update(&buffer[0], n_bytes);
+        for (size_t i = 0; i < n_bytes; i++)
+        {
+            h = (h << 1) + gear[(uint8_t) buffer[i]];
+            size_t len = current.size() + i - start + 1;
+            if (len < MIN_CHUNK)
+                continue;
+            if ((h & CHUNK_MASK) == 0 || len >= MAX_CHUNK)
+            {
+                current.append(&buffer[start], i - start + 1);
+                chunks.push_back({chunk_hash(current.data(), current.size()), (uint32_t) current.size()});
+                current.clear();
+                start = i + 1;
+                h = 0;
+            }
+        }
+        current.append(&buffer[start], n_bytes - start);
+    }
+    if (!current.empty())
+    {
+        chunks.push_back({chunk_hash(current.data(), current.size()), (uint32_t) current.size()});
+    }
+    if (digest != NULL)
+        *digest = sha.hex();
+    return chunks;
+}
+
+// regular files under root/rel, paths relative to root
+inline void list_files(const std::string &root, const std::string &rel, std::vector<std::string> &files)
+{
+    DIR *dir = opendir((root + "/" + rel).c_str());
+    if (dir == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name == "." || name == ".." || (rel.empty() && name == SYNC_STAGING))
+            continue;
+
+        std::string path = rel.empty() ? name : rel + "/" + name;
+        struct stat path_stat;
+        if (lstat((root + "/" + path).c_str(), &path_stat) == -1)
+            continue;
+        if (S_ISDIR(path_stat.st_mode))
+            list_files(root, path, files);
+        else if (S_ISREG(path_stat.st_mode))
+            files.push_back(path);
+    }
+    closedir(dir);
+}
+
+// the chunks and digest of the file at path, from the cache if it has
+// not changed; one that cannot be stat'ed is read every time
+inline const Chunked_file &cached_chunks(const std::string &path, Chunk_cache &cache)
+{
+    struct stat path_stat;
+    if (stat(path.c_str(), &path_stat) == -1)
+        memset(&path_stat, 0, sizeof(path_stat));
+
+    Chunked_file &cached = cache[path];
+    if (cached.digest.empty() || path_stat.st_ino == 0 || cached.inode != path_stat.st_ino ||
+        cached.size != (uint64_t) path_stat.st_size || cached.mtime.tv_sec != path_stat.st_mtim.tv_sec ||
+        cached.mtime.tv_nsec != path_stat.st_mtim.tv_nsec)
+    {
+        cached.inode = path_stat.st_ino;
+        cached.size = path_stat.st_size;
+        cached.mtime = path_stat.st_mtim;
+        cached.chunks = chunk_file(path, &cached.digest);
+    }
+    return cached;
+}
+
+// every chunk of every file under dir, by hash; with a cache, files are
+// only read again once they change, and ones gone from dir are dropped
+inline void index_dir(const std::string &dir, Chunk_index &index, std::vector<Manifest_file> *files = NULL, Chunk_cache *cache = NULL)
+{
+    std::vector<std::string> paths;
+    list_files(dir, "", paths);
+    if (cache != NULL)
+    {
+        std::unordered_set<std::string> listed;
+        for (const std::string &path : paths)
+        {
+            listed.insert(dir + "/" + path);
+        }
+        for (auto i = cache->begin(); i != cache->end();)
+        {
+            if (i->first.compare(0, dir.size() + 1, dir + "/") == 0 && listed.count(i->first) == 0)
+                i = cache->erase(i);
+            else
+                ++i;
+        }
+    }
+
+    for (const std::string &path : paths)
+    {
+        Manifest_file file;
+        file.path = path;
+        file.size = 0;
+        if (cache != NULL)
+        {
+            const Chunked_file &cached = cached_chunks(dir + "/" + path, *cache);
+            file.chunks = cached.chunks;
+            file.digest = cached.digest;
+        }
+        else
+        {
+            file.chunks = chunk_file(dir + "/" + path, files != NULL ? &file.digest : NULL);
+        }
+        for (const Chunk &c : file.chunks)
+        {
+            index.emplace(c.hash, Chunk_location{dir + "/" + path, file.size, c.len});
+            file.size += c.len;
+        }
+        if (files != NULL)
+            files->push_back(file);
+    }
+}
+
+// text manifest: "F size n_chunks digest path" then "hash len" per chunk
+inline std::string build_manifest(const std::string &dir, Chunk_index &index, Chunk_cache &cache)
+{
+    std::vector<Manifest_file> files;
+    index.clear();
+    index_dir(dir, index, &files, &cache);
+
+    std::ostringstream manifest;
+    for (const Manifest_file &file : files)
+    {
+        manifest << "F " << file.size << ' ' << file.chunks.size() << ' ' << file.digest << ' ' << file.path << '\n';
+        for (const Chunk &c : file.chunks)
+        {
+            manifest << std::hex << c.hash << std::dec << ' ' << c.len << '\n';
+        }
+    }
+    return manifest.str();
+}
+
+inline bool parse_manifest(std::istream &in, std::vector<Manifest_file> &files)
+{
+    std::string tag;
+    while (in >> tag)
+    {
+        Manifest_file file;
+        size_t n_chunks;
+        if (tag != "F" || !(in >> file.size >> n_chunks >> file.digest) || in.get() != ' ' || !getline(in, file.path))
+            return false;
+        if (file.digest.size() != DIGEST_HEX_LEN || file.digest.find_first_not_of("0123456789abcdef") != std::string::npos)
+            return false;
+        if (!safe_path(file.path) || file.path.compare(0, sizeof(SYNC_STAGING) - 1, SYNC_STAGING) == 0)
+            return false;
+        for (size_t i = 0; i < n_chunks; i++)
+        {
+            Chunk c;
+            if (!(in >> std::hex >> c.hash >> std::dec >> c.len))
+                return false;
+            file.chunks.push_back(c);
+        }
+        files.push_back(file);
+    }
+    return true;
+}
+
+inline bool read_chunk(const Chunk_location &loc, std::string &data)
+{
+    std::ifstream in(loc.path, std::ios::binary);
+    data.resize(loc.len);
+    in.seekg(loc.offset);
+    in.read(&data[0], loc.len);
+    return (size_t) in.gcount() == loc.len;
+}
+
+// body of a /chunks reply: [hash][len][data] for each chunk we still have
+inline std::string build_chunks(const std::string &request, const Chunk_index &index)
+{
+    std::istringstream hashes(request.substr(sizeof(SYNC_CHUNKS) - 1));
+    std::string reply;
+    uint64_t hash;
+    while (hashes >> std::hex >> hash)
+    {
+        auto found = index.find(hash);
+        std::string data;
+        if (found == index.end() || !read_chunk(found->second, data))
+            continue;
+
+        uint32_t len = data.size();
+        reply.append((const char *) &hash, sizeof(hash));
+        reply.append((const char *) &len, sizeof(len));
+        reply += data;
+    }
+    return reply;
+}
+
+// adds the chunks in a saved /chunks reply to the index, dropping any
+// whose content does not match its hash
+inline void index_chunks(const std::string &path, Chunk_index &index)
+{
+    std::ifstream in(path, std::ios::binary);
+    uint64_t offset = 0;
+    char header[CHUNK_ENTRY_LEN];
+    while (in.read(header, CHUNK_ENTRY_LEN))
+    {
+        uint64_t hash;
+        uint32_t len;
+        memcpy(&hash, header, sizeof(hash));
+        memcpy(&len, header + sizeof(hash), sizeof(len));
+        offset += CHUNK_ENTRY_LEN;
+
+        std::string data(len, '\0');
+        if (!in.read(&data[0], len))
+            break;
+        if (chunk_hash(data.data(), len) == hash)
+            index.emplace(hash, Chunk_location{path, offset, len});
+        offset += len;
+    }
+}
+
+// mkdir -p for the directories above path
+inline void make_parents(const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+    {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+}
+
+// writes every manifest file from indexed chunks into temporaries first,
+// so chunks reused from files being replaced are read before they change;
+// nothing is renamed into place unless every file matches its digest
+inline bool assemble(const std::string &dir, const std::vector<Manifest_file> &files, const Chunk_index &index)
+{
+    std::string data;
+    for (const Manifest_file &file : files)
+    {
+        std::string tmp = dir + "/" + SYNC_STAGING + "/" + std::to_string(&file - &files[0]) + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        Sha256 sha;
+        for (const Chunk &c : file.chunks)
+        {
+            auto found = index.find(c.hash);
+            if (found == index.end() || found->second.len != c.len || !read_chunk(found->second, data))
+                return false;
+            out.write(data.data(), data.size());
+            sha.update(data.data(), data.size());
+        }
+        if (!out || sha.hex() != file.digest)
+            return false;
+    }
+
+    for (const Manifest_file &file : files)
+    {
+        std::string tmp = dir + "/" + SYNC_STAGING + "/" + std::to_string(&file - &files[0]) + ".tmp";
+        std::string path = dir + "/" + file.path;
+        make_parents(path);
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            return false;
+    }
+    return true;
+}
+#endif
@@ -0,0 +1,53 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "packet.h"
+#include <string> // for string
+
+// the protocol engines in server_connection.h and client_connection.h never
+// touch a socket, a file or the clock: the caller feeds them datagrams and
+// the current time in microseconds, sends whatever poll_transmit() hands
+// back, and calls on_timeout() once next_timeout() has passed
+
+const uint16_t MAX_RECV_WINDOW = MSN / 2; // bytes, advertised by the client
+const size_t SEND_BUFFER = 65536; // bytes a server connection accepts ahead of the wire
+
+// one datagram to put on the wire, len includes the header
+struct Transmit
+{
+    Packet pkt;
+    size_t len;
+    bool   probe;     // path MTU probe, report EMSGSIZE through on_send_error()
+    bool   challenge; // path challenge, goes to the address being validated
+};
+
+enum Event_type
+{
+    EVENT_CONNECTED, // client: handshake done, cookie() is valid
+    EVENT_REQUEST, // server: name holds the request, write() the response
+    EVENT_RESPONSE_END, // client: response complete, read() it and request() the next one
+    EVENT_PATH_VALIDATED, // server: the client answered from its new address, send there from now on
+    EVENT_PATH_FAILED, // server: the new address never answered, go back to the last validated one
+    EVENT_CLOSED, // connection shut down cleanly
+    EVENT_TIMED_OUT, // server: the client stopped answering, the connection is closed
+    EVENT_ERROR // peer broke the protocol, name holds what went wrong
+};
+
+// what one connection learned about the path to its peer, for seeding
+// the next one (see path_cache.h)
+struct Path_metrics
+{
+    uint64_t srtt; // us, smoothed RTT
+    uint64_t rttvar; // us
+    uint16_t ssthresh; // bytes
+    uint64_t bandwidth; // bytes per second delivered while data was in flight
+    uint64_t delivered; // bytes the bandwidth was measured over
+};
+
+struct Event
+{
+    Event_type  type;
+    std::string name;
+    bool        more; // EVENT_REQUEST: another request follows this one
+};
+#endif
@@ -0,0 +1,216 @@
+#ifndef UDP_OFFLOAD_H
+#define UDP_OFFLOAD_H
+
+#include "packet.h"
+#include <cstring> // for memcpy
+#include <vector> // for vector
+#include <algorithm> // for min
+#include <errno.h> // for errno
+#include <sys/socket.h> // for sendmsg, recvmsg
+#include <netinet/in.h> // for IPPROTO_UDP
+#include <sys/uio.h> // for iovec
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // linux 4.18+
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104 // linux 5.0+
+#endif
+
+const uint16_t GSO_MAX_SEGMENTS = 64; // kernel limit per send
+const size_t GSO_MAX_BYTES = 65507; // max UDP payload over IPv4
+
+// returns true if the kernel accepts UDP_SEGMENT on this socket
+inline bool gso_supported(int sockfd)
+{
+    int gso_size = 0;
+    socklen_t len = sizeof(gso_size);
+    return getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &gso_size, &len) == 0;
+}
+
+// asks the kernel to hand us coalesced bursts, returns false if unsupported
+inline bool enable_gro(int sockfd)
+{
+    int yes = 1;
+    return setsockopt(sockfd, SOL_UDP, UDP_GRO, &yes, sizeof(yes)) == 0;
+}
+
+// packs consecutive equal-sized segments into one buffer so a single
+// sendmsg with a UDP_SEGMENT cmsg replaces one sendto per segment
+class Gso_batch
+{
+public:
+    Gso_batch()
+    {
+        m_buffer.resize(GSO_MAX_BYTES);
+        m_seg_size = 0;
+        m_len = 0;
+        m_count = 0;
+    }
+
+    bool empty() const
+    {
+        return m_count == 0;
+    }
+
+    // only the last segment of a batch may be shorter than the rest
+    bool fits(size_t len) const
+    {
+        if (m_count == 0)
+            return true;
+        return len <= m_seg_size && m_len % m_seg_size == 0 &&
+               m_count < GSO_MAX_SEGMENTS && m_len + len <= GSO_MAX_BYTES;
+    }
+
+    // caller must check fits() first
+    void append(const char *datagram, size_t len)
+    {
+        if (m_count == 0)
+            m_seg_size = len;
+        memcpy(&m_buffer[m_len], datagram, len);
+        m_len += len;
+        m_count++;
+    }
+
+    // returns bytes sent, or -1 with errno set
+    int flush(int sockfd, const struct sockaddr *addr, socklen_t addr_len)
+    {
+        if (m_count == 0)
+            return 0;
+
+        struct iovec iov;
+        iov.iov_base = &m_buffer[0];
+        iov.iov_len = m_len;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void *) addr;
+        msg.msg_namelen = addr_len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        // a single segment goes out as a plain datagram
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        if (m_count > 1)
+        {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = m_seg_size;
+            memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+        }
+
+        int status = sendmsg(sockfd, &msg, 0);
+        m_len = 0;
+        m_count = 0;
+        return status;
+    }
+
+private:
+    std::vector<char> m_buffer;
+    size_t   m_seg_size;
+    size_t   m_len;
+    uint16_t m_count;
+};
+
+// hands out one datagram at a time, splitting GRO-coalesced bursts
+// back into the segments the sender produced
+class Gro_reader
+{
+public:
+    Gro_reader(bool gro)
+    {
+        m_gro = gro;
+        m_buffer.resize(gro ? GSO_MAX_BYTES : sizeof(Packet));
+        m_len = 0;
+        m_pos = 0;
+        m_seg_size = 0;
+        m_from_len = 0;
+    }
+
+    // like recv, but the datagram is left where the kernel put it: data
+    // points into the reader's buffer until the next call; returns its
+    // length, or -1 with errno set
+    int next(int sockfd, const char *&data)
+    {
+        if (m_pos >= m_len)
+        {
+            int status = fill(sockfd);
+            if (status <= 0)
+                return status;
+        }
+
+        size_t len = std::min(m_seg_size, m_len - m_pos);
+        data = &m_buffer[m_pos];
+        m_pos += m_seg_size;
+        return len;
+    }
+
+    // who sent the datagram next() returned last
+    const struct sockaddr_storage &from() const
+    {
+        return m_from;
+    }
+
+    socklen_t from_len() const
+    {
+        return m_from_len;
+    }
+
+private:
+    int fill(int sockfd)
+    {
+        struct iovec iov;
+        iov.iov_base = &m_buffer[0];
+        iov.iov_len = m_buffer.size();
+
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &m_from;
+        msg.msg_namelen = sizeof(m_from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (m_gro)
+        {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+        }
+
+        int n_bytes = recvmsg(sockfd, &msg, 0);
+        if (n_bytes <= 0)
+            return n_bytes;
+
+        m_from_len = msg.msg_namelen;
+        m_len = n_bytes;
+        m_pos = 0;
+        m_seg_size = m_len; // not coalesced unless the kernel says so
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                if (gso_size > 0)
+                    m_seg_size = gso_size;
+            }
+        }
+        return n_bytes;
+    }
+
+    bool                    m_gro;
+    std::vector<char>       m_buffer;
+    struct sockaddr_storage m_from;
+    socklen_t               m_from_len;
+    size_t                  m_len;
+    size_t                  m_pos;
+    size_t                  m_seg_size;
+};
+#endif
@@ -0,0 +1,217 @@
+#ifndef URING_H
+#define URING_H
+
+// build with -DNO_IO_URING to leave the io_uring path out entirely; it
+// also stays out with headers older than the 5.11 wait with a timeout
+#if !defined(NO_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h> // for io_uring_sqe, io_uring_cqe
+#ifdef IORING_FEAT_EXT_ARG
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h> // for __NR_io_uring_setup
+#include <sys/mman.h> // for mmap
+#include <sys/socket.h> // for msghdr
+#include <sys/uio.h> // for iovec
+#include <unistd.h> // for syscall, close
+#include <signal.h> // for _NSIG
+#include <cstring> // for memset
+#include <errno.h> // for errno
+
+// just enough of io_uring for the drivers, straight on the system calls
+// since liburing is not a dependency: one submission and one completion
+// ring, optional registered buffers, and a wait with a timeout
+class Uring
+{
+public:
+    Uring()
+    {
+        m_fd = -1;
+        m_sq_ptr = m_cq_ptr = m_sqes = MAP_FAILED;
+        m_to_submit = 0;
+    }
+
+    ~Uring()
+    {
+        if (m_sqes != MAP_FAILED)
+            munmap(m_sqes, m_sqes_len);
+        if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+            munmap(m_cq_ptr, m_cq_len);
+        if (m_sq_ptr != MAP_FAILED)
+            munmap(m_sq_ptr, m_sq_len);
+        if (m_fd != -1)
+            close(m_fd);
+    }
+
+    // returns false if the kernel has no io_uring, blocks it, or is too
+    // old to wait with a timeout (5.11)
+    bool init(unsigned entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd == -1)
+            return false;
+        if (!(params.features & IORING_FEAT_EXT_ARG))
+            return false;
+
+        m_sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            m_sq_len = m_cq_len = m_sq_len > m_cq_len ? m_sq_len : m_cq_len;
+
+        m_sq_ptr = mmap(NULL, m_sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ptr == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            m_cq_ptr = m_sq_ptr;
+        else
+            m_cq_ptr = mmap(NULL, m_cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED)
+            return false;
+        m_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_sqes = mmap(NULL, m_sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED)
+            return false;
+
+        char *sq = (char *) m_sq_ptr;
+        char *cq = (char *) m_cq_ptr;
+        m_sq_head = (unsigned *) (sq + params.sq_off.head);
+        m_sq_tail = (unsigned *) (sq + params.sq_off.tail);
+        m_sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+        m_sq_entries = params.sq_entries;
+        m_sq_array = (unsigned *) (sq + params.sq_off.array);
+        m_cq_head = (unsigned *) (cq + params.cq_off.head);
+        m_cq_tail = (unsigned *) (cq + params.cq_off.tail);
+        m_cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+        m_cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // pins buffers so fixed reads and writes skip mapping them per call
+    bool register_buffers(const struct iovec *iovs, unsigned n)
+    {
+        return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, iovs, n) == 0;
+    }
+
+    void recvmsg(int fd, struct msghdr *msg, uint64_t user_data)
+    {
+        prep(IORING_OP_RECVMSG, fd, msg, 1, 0, user_data);
+    }
+
+    void sendmsg(int fd, const struct msghdr *msg, uint64_t user_data)
+    {
+        prep(IORING_OP_SENDMSG, fd, msg, 1, 0, user_data);
+    }
+
+    void read_fixed(int fd, char *buf, unsigned len, uint64_t offset, uint16_t buf_index, uint64_t user_data)
+    {
+        prep(IORING_OP_READ_FIXED, fd, buf, len, offset, user_data)->buf_index = buf_index;
+    }
+
+    void read(int fd, char *buf, unsigned len, uint64_t offset, uint64_t user_data)
+    {
+        prep(IORING_OP_READ, fd, buf, len, offset, user_data);
+    }
+
+    void write(int fd, const char *buf, unsigned len, uint64_t offset, uint64_t user_data)
+    {
+        prep(IORING_OP_WRITE, fd, buf, len, offset, user_data);
+    }
+
+    // cancels the request queued with target as its user_data; it comes
+    // back with -ECANCELED unless it had already completed
+    void cancel(uint64_t target, uint64_t user_data)
+    {
+        prep(IORING_OP_ASYNC_CANCEL, -1, (const void *) target, 0, 0, user_data);
+    }
+
+    // submits everything queued, then waits up to timeout_us (-1 for no
+    // limit, 0 to only submit) for a completion; -1 with errno on error
+    int submit_and_wait(int64_t timeout_us)
+    {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        unsigned flags = IORING_ENTER_EXT_ARG;
+        unsigned wait_nr = 0;
+        if (timeout_us != 0)
+        {
+            flags |= IORING_ENTER_GETEVENTS;
+            wait_nr = 1;
+        }
+        if (timeout_us > 0)
+        {
+            ts.tv_sec = timeout_us / 1000000;
+            ts.tv_nsec = (timeout_us % 1000000) * 1000;
+            arg.ts = (uint64_t) &ts;
+        }
+
+        int status = syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait_nr, flags, &arg, sizeof(arg));
+        if (status >= 0)
+            m_to_submit -= status;
+        else if (errno == ETIME || errno == EINTR)
+            return 0;
+        return status;
+    }
+
+    // takes the oldest completion, false if there is none
+    bool next_cqe(struct io_uring_cqe &cqe)
+    {
+        unsigned head = *m_cq_head;
+        if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = m_cqes[head & m_cq_mask];
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    struct io_uring_sqe *prep(uint8_t opcode, int fd, const void *addr, unsigned len, uint64_t offset, uint64_t user_data)
+    {
+        unsigned tail = *m_sq_tail;
+        if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_sq_entries)
+        {
+            submit_and_wait(0); // full, hand what we have to the kernel first
+            tail = *m_sq_tail;
+        }
+
+        struct io_uring_sqe *sqe = &((struct io_uring_sqe *) m_sqes)[tail & m_sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) addr;
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        m_sq_array[tail & m_sq_mask] = tail & m_sq_mask;
+        __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        m_to_submit++;
+        return sqe;
+    }
+
+    int      m_fd;
+    void    *m_sq_ptr;
+    void    *m_cq_ptr;
+    void    *m_sqes;
+    size_t   m_sq_len;
+    size_t   m_cq_len;
+    size_t   m_sqes_len;
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned  m_sq_mask;
+    unsigned  m_sq_entries;
+    unsigned *m_sq_array;
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned  m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+    unsigned  m_to_submit;
+};
+#endif
+#endif